@@ -36,12 +36,20 @@
 #endif
 
 #include <sys/param.h>
+#include <sys/buf_ring.h>
 #include <sys/endian.h>
+#include <sys/hash.h>
 #include <sys/kernel.h>
+#include <sys/lock.h>
 #include <sys/mbuf.h>
+#include <sys/mutex.h>
+#include <sys/priority.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/sysctl.h>
 #include <sys/systm.h>
 #include <sys/syslog.h>
+#include <sys/taskqueue.h>
 
 #include <net/bpf.h>
 #include <net/if.h>
@@ -53,6 +61,12 @@
 #include <netinet/in.h>
 #include <netinet/in_var.h>
 #include <netinet/ip.h>
+#include <netinet/ip_var.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_seq.h>
+#endif
+#ifdef INET6
+#include <netinet/ip6.h>
 #endif
 
 #include <dev/usb/usb.h>
@@ -61,7 +75,10 @@
 #endif
 
 #include "mbim.h"
+#include "umb_ackf.h"
+#include "umb_fq.h"
 #include "if_umbreg.h"
+#include "umb_ntb.h"
 
 #ifdef UMB_DEBUG
 #define DPRINTF(x...)							\
@@ -93,6 +110,71 @@ static void	 umb_dump(void *, int);
  */
 #define UMB_STATE_CHANGE_TIMEOUT	30
 
+/*
+ * Upper bound for the number of datagrams packed into one out-NTB
+ */
+#define UMB_TX_MAXDGRAMS		32
+
+/*
+ * Never allocate out-NTB buffers larger than this, whatever the device says
+ */
+#define UMB_NTB_MAXSIZE			(256 * 1024)
+
+/*
+ * Upper bound for wNtbOutDivisor and wNtbOutAlignment we are willing
+ * to pad for
+ */
+#define UMB_NTB_MAXALIGN		512
+
+/*
+ * Smallest dwNtbInMaxSize NCM allows
+ */
+#define UMB_NTB_MINSIZE			2048
+
+/*
+ * In-NTB size picked at connect, umb_rx_ntbconnect: NTBs to judge by,
+ * the completion rate (NTBs/s) worth growing for, and how small to go
+ */
+#define UMB_RX_ADAPT_NTBS		1000
+#define UMB_RX_ADAPT_RATE		1000
+#define UMB_RX_ADAPT_MIN		(16 * 1024)
+
+/*
+ * Flow hash of received packets, umb_rx_flowid
+ */
+#define UMB_FLOWID_OFF			0
+#define UMB_FLOWID_JENKINS		1
+#define UMB_FLOWID_CRC32C		2
+
+/*
+ * Datagrams the RX poll task passes up before it yields, umb_rx_budget
+ */
+#define UMB_RX_BUDGET			64
+
+/*
+ * Autorate limits (bytes/s) and how often the rate may change (usec)
+ */
+#define UMB_AUTORATE_MIN		(64000 / 8)
+#define UMB_AUTORATE_MAX		(1000000000 / 8)
+#define UMB_AUTORATE_INTERVAL		20000
+
+/* Packets each send ring holds, a power of 2 */
+#define UMB_TX_RING_LEN			1024
+
+/* Byte queue limit to start from, and its ceiling */
+#define UMB_TX_BQL_MAX			(1024*1024)
+
+/* DSCP from which packets go to the priority lane (CS5, EF, CS6, CS7) */
+#define UMB_TX_PRIO_DSCP		40
+
+/* Pure ACK tracked by the ACK filter */
+#define M_UMB_ACKF		M_PROTO1
+
+/* Offset of the first datagram behind the NTH and an NDP for n datagrams */
+#define UMB_NTB_HDRLEN(sc, n)						\
+	((sc)->sc_tx_ndpoffs + (((sc)->sc_flags & UMBFLG_NTB32) ?	\
+	    MBIM_NDP32_LEN(n) : MBIM_NDP16_LEN(n)))
+
 /*
  * State change flags
  */
@@ -131,6 +213,8 @@ static device_attach_t umb_attach;
 static device_detach_t umb_detach;
 static int	 umb_activate(device_t, enum devact);
 static void	 umb_ncm_setup(struct umb_softc *);
+static int	 umb_ncm_insize(struct umb_softc *, int);
+static void	 umb_rx_connect_ntbsize(struct umb_softc *);
 static int	 umb_alloc_xfers(struct umb_softc *);
 static void	 umb_free_xfers(struct umb_softc *);
 static int	 umb_alloc_bulkpipes(struct umb_softc *);
@@ -139,9 +223,36 @@ static int	 umb_ioctl(struct ifnet *, u_long, void *);
 static int	 umb_output(struct ifnet *, struct mbuf *,
 		    const struct sockaddr *, const struct rtentry *);
 static void	 umb_input(struct ifnet *, struct mbuf *);
-static void	 umb_start(struct ifnet *);
+static int	 umb_transmit(struct ifnet *, struct mbuf *);
+static void	 umb_qflush(struct ifnet *);
+static void	 umb_tx_purge(struct umb_softc *);
+static int	 umb_tx_enqueue(struct umb_softc *, int, struct mbuf *);
+static int	 umb_tx_classify(struct mbuf *);
+static struct mbuf *umb_tx_peek(struct umb_softc *, int *);
+static void	 umb_tx_dequeue(struct umb_softc *, int, struct mbuf *);
+static int	 umb_tx_empty(struct umb_softc *);
+static int	 umb_tx_qlen(struct umb_softc *);
+static int	 umb_ackf_enqueue(struct umb_softc *, struct buf_ring *,
+		    struct mbuf *);
+static int	 umb_ackf_obsolete(struct umb_softc *, struct mbuf *);
+static void	 umb_tx_fq_init(struct umb_softc *);
+static uint32_t	 umb_flow_hash(struct mbuf *, uint32_t, int);
+static u_int	 umb_fq_hash(struct umb_softc *, struct mbuf *);
+static struct mbuf *umb_tx_fq_peek(struct umb_softc *);
+static void	 umb_tx_fq_drop(void *, struct mbuf *);
+static void	 umb_tx_fq_stats(struct umb_softc *);
+static int	 umb_start_locked(struct umb_softc *);
+static void	 umb_tx_unlock(struct umb_softc *, int);
+static int	 umb_tx_hold(struct umb_softc *);
+static void	 umb_tx_timeout(void *);
+static void	 umb_tx_shape_update(struct umb_softc *);
+static int	 umb_tx_shape(struct umb_softc *);
+static void	 umb_tx_shape_timeout(void *);
+static void	 umb_tx_autorate(struct umb_softc *, struct umb_tx *);
+static void	 umb_tx_bql(struct umb_softc *, struct umb_tx *);
 static void	 umb_watchdog(struct ifnet *);
 static void	 umb_statechg_timeout(void *);
+static void	 umb_stats_timeout(void *);
 
 static int	 umb_mediachange(struct ifnet *);
 static void	 umb_mediastatus(struct ifnet *, struct ifmediareq *);
@@ -167,11 +278,34 @@ static int	 umb_decode_packet_service(struct umb_softc *, void *, int);
 static int	 umb_decode_signal_state(struct umb_softc *, void *, int);
 static int	 umb_decode_connect_info(struct umb_softc *, void *, int);
 static int	 umb_decode_ip_configuration(struct umb_softc *, void *, int);
-static void	 umb_rx(struct umb_softc *);
+static int	 umb_decode_packet_statistics(struct umb_softc *, void *, int);
+static void	 umb_rx(struct umb_softc *, struct umb_rx *);
 static void	 umb_rxeof(struct usbd_xfer *, void *, usbd_status);
-static int	 umb_encap(struct umb_softc *, struct mbuf *);
+static int	 umb_rx_done(struct umb_softc *, struct umb_rx *);
+static void	 umb_rx_poll_task(void *, int);
+static int	 umb_encap(struct umb_softc *, struct umb_tx *);
+static int	 umb_tx_align(struct umb_softc *, int);
+static void	 umb_tx_freem(struct mbuf *);
+static struct mbuf *umb_tso_prepare(struct mbuf *);
+static int	 umb_tso_hlen(struct mbuf *);
+static void	 umb_tso_copy(struct mbuf *, int, int, int, char *);
+static uint32_t	 umb_cksum(const void *, int, uint32_t);
 static void	 umb_txeof(struct usbd_xfer *, void *, usbd_status);
-static void	 umb_decap(struct umb_softc *, struct usbd_xfer *);
+static int	 umb_decap(struct umb_softc *, struct usbd_xfer *,
+		    struct umb_rxbuf *);
+static struct umb_rxpool *umb_rxpool_create(int);
+static void	 umb_rxpool_destroy(struct umb_rxpool *);
+static struct umb_rxbuf *umb_rxbuf_get(struct umb_rxpool *);
+static void	 umb_rxbuf_put(struct umb_rxbuf *);
+static void	 umb_rxbuf_lend(struct umb_rxbuf *);
+static void	 umb_rxbuf_extfree(struct mbuf *);
+static int	 umb_gro_input(struct umb_softc *, struct umb_gro *,
+		    struct mbuf *);
+static int	 umb_gro_check(struct mbuf *, int *);
+static void	 umb_gro_append(struct umb_gro *, struct mbuf *, int, int);
+static void	 umb_gro_close(struct umb_softc *, struct umb_gro *);
+static struct mbuf *umb_rxbuf_mbuf(struct umb_rxbuf *, struct ifnet *,
+		    char *, int);
 
 static usbd_status	 umb_send_encap_command(struct umb_softc *, void *, int);
 static int	 umb_get_encap_response(struct umb_softc *, void *, int *);
@@ -204,6 +338,74 @@ static char	*umb_ntop(struct sockaddr *);
 
 static int	 umb_xfer_tout = USB_DEFAULT_TIMEOUT;
 
+static SYSCTL_NODE(_hw_usb, OID_AUTO, umb, CTLFLAG_RW, 0, "USB MBIM");
+
+static int	 umb_tx_list_cnt = UMB_TX_LIST_CNT;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, tx_list_cnt, CTLFLAG_RWTUN,
+    &umb_tx_list_cnt, 0, "Bulk-OUT transfers in flight (1-8)");
+
+static int	 umb_rx_list_cnt = UMB_RX_LIST_CNT;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, rx_list_cnt, CTLFLAG_RWTUN,
+    &umb_rx_list_cnt, 0, "Bulk-IN transfers posted (1-8)");
+
+static int	 umb_rx_flowid = UMB_FLOWID_JENKINS;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, rx_flowid, CTLFLAG_RWTUN,
+    &umb_rx_flowid, 0,
+    "Flow hash of received packets (0 = none, 1 = Jenkins, 2 = CRC32C)");
+
+static int	 umb_rx_zerocopy = 0;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, rx_zerocopy, CTLFLAG_RWTUN,
+    &umb_rx_zerocopy, 0, "Pass received datagrams up without copying");
+
+static int	 umb_rx_ntbsize = 0;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, rx_ntbsize, CTLFLAG_RWTUN,
+    &umb_rx_ntbsize, 0, "In-NTB size to ask for (0 = largest possible)");
+
+static int	 umb_rx_ntbconnect = 0;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, rx_ntbconnect, CTLFLAG_RWTUN,
+    &umb_rx_ntbconnect, 0,
+    "Re-pick the in-NTB size at each connect from the downlink load");
+
+static int	 umb_rx_poll = 0;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, rx_poll, CTLFLAG_RWTUN,
+    &umb_rx_poll, 0,
+    "Decapsulate in a poll task when the RX ring runs low (rx_list_cnt > 1)");
+
+static int	 umb_rx_budget = UMB_RX_BUDGET;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, rx_budget, CTLFLAG_RWTUN,
+    &umb_rx_budget, 0, "Datagrams per pass of the RX poll task");
+
+static int	 umb_tx_bql_target = 10000;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, tx_bql_target, CTLFLAG_RWTUN,
+    &umb_tx_bql_target, 0,
+    "Drain time of queued and in-flight TX bytes, usec (0 = unlimited)");
+
+static int	 umb_tx_prio_maxlen = 128;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, tx_prio_maxlen, CTLFLAG_RWTUN,
+    &umb_tx_prio_maxlen, 0, "Send packets up to this size ahead of bulk data");
+
+static int	 umb_fq_target = 5000;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, fq_target, CTLFLAG_RWTUN,
+    &umb_fq_target, 0, "FQ-CoDel target queueing delay, usec");
+
+static int	 umb_fq_interval = 100000;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, fq_interval, CTLFLAG_RWTUN,
+    &umb_fq_interval, 0, "FQ-CoDel interval, usec");
+
+static int	 umb_fq_limit = 1024;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, fq_limit, CTLFLAG_RWTUN,
+    &umb_fq_limit, 0, "FQ-CoDel packets queued on all flows");
+
+static int	 umb_autorate_delay = 2000;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, autorate_delay, CTLFLAG_RWTUN,
+    &umb_autorate_delay, 0,
+    "TX completion delay above baseline that lowers the autorate, usec");
+
+static int	 umb_stats_interval = 10;
+SYSCTL_INT(_hw_usb_umb, OID_AUTO, stats_interval, CTLFLAG_RWTUN,
+    &umb_stats_interval, 0,
+    "Seconds between modem packet statistics queries (0 = never)");
+
 static uint8_t	 umb_uuid_basic_connect[] = MBIM_UUID_BASIC_CONNECT;
 static uint8_t	 umb_uuid_context_internet[] = MBIM_UUID_CONTEXT_INTERNET;
 static uint8_t	 umb_uuid_qmi_mbim[] = MBIM_UUID_QMI_MBIM;
@@ -381,6 +583,9 @@ umb_attach(device_t dev)
 				/* cont. anyway */
 			}
 			sc->sc_maxpktlen = UGETW(md->wMaxSegmentSize);
+			if (md->bmNetworkCapabilities &
+			    MBIM_NETCAP_NTBINPUTSIZE8)
+				sc->sc_flags |= UMBFLG_NTBINPUTSIZE8;
 			DPRINTFN(2, "%s: ctrl_len=%d, maxpktlen=%d, cap=0x%x\n",
 			    DEVNAM(sc), sc->sc_ctrl_len, sc->sc_maxpktlen,
 			    md->bmNetworkCapabilities);
@@ -460,6 +665,13 @@ umb_attach(device_t dev)
 		    data_ifaceno);
 		goto fail;
 	}
+
+	/*
+	 * The NTB format may only be changed while the data interface
+	 * is still in alternate setting 0.
+	 */
+	umb_ncm_setup(sc);
+
 	status = usbd_set_interface(sc->sc_data_iface, i);
 	if (status) {
 		aprint_error_dev(self, "select alt setting %d for interface #%d "
@@ -477,8 +689,10 @@ umb_attach(device_t dev)
 		    UE_GET_DIR(ed->bEndpointAddress) == UE_DIR_IN)
 			sc->sc_rx_ep = ed->bEndpointAddress;
 		else if (UE_GET_XFERTYPE(ed->bmAttributes) == UE_BULK &&
-		    UE_GET_DIR(ed->bEndpointAddress) == UE_DIR_OUT)
+		    UE_GET_DIR(ed->bEndpointAddress) == UE_DIR_OUT) {
 			sc->sc_tx_ep = ed->bEndpointAddress;
+			sc->sc_tx_mps = UGETW(ed->wMaxPacketSize);
+		}
 	}
 	if (sc->sc_rx_ep == -1 || sc->sc_tx_ep == -1) {
 		aprint_error_dev(self, "missing bulk endpoints\n");
@@ -496,6 +710,22 @@ umb_attach(device_t dev)
 	    0);
 	callout_init(&sc->sc_statechg_timer, 0);
 	callout_setfunc(&sc->sc_statechg_timer, umb_statechg_timeout, sc);
+	callout_init(&sc->sc_tx_timer, 0);
+	callout_init(&sc->sc_tx_shape_timer, 0);
+	callout_init(&sc->sc_stats_timer, 0);
+	mtx_init(&sc->sc_tx_mtx, DEVNAM(sc), "umb tx", MTX_DEF);
+	mtx_init(&sc->sc_ackf_mtx, DEVNAM(sc), "umb ackf", MTX_DEF);
+	mtx_init(&sc->sc_rx_mtx, DEVNAM(sc), "umb rx", MTX_DEF);
+	STAILQ_INIT(&sc->sc_rx_pollq);
+	TASK_INIT(&sc->sc_rx_task, 0, umb_rx_poll_task, sc);
+	sc->sc_rx_tq = taskqueue_create("umb_rx", M_WAITOK,
+	    taskqueue_thread_enqueue, &sc->sc_rx_tq);
+	taskqueue_start_threads(&sc->sc_rx_tq, 1, PI_NET, "%s rx",
+	    DEVNAM(sc));
+	umb_tx_fq_init(sc);
+	for (i = 0; i < UMB_TX_NLANES; i++)
+		sc->sc_tx_br[i] = buf_ring_alloc(UMB_TX_RING_LEN, M_USB_UMB,
+		    M_WAITOK, &sc->sc_tx_mtx);
 
 	if (usbd_open_pipe_intr(uiaa->uiaa_iface, ctrl_ep, USBD_SHORT_XFER_OK,
 	    &sc->sc_ctrl_pipe, sc, &sc->sc_intr_msg, sizeof(sc->sc_intr_msg),
@@ -511,9 +741,9 @@ umb_attach(device_t dev)
 	sc->sc_info.rssi = UMB_VALUE_UNKNOWN;
 	sc->sc_info.ber = UMB_VALUE_UNKNOWN;
 
-	umb_ncm_setup(sc);
-	DPRINTFN(2, "%s: rx/tx size %d/%d\n", DEVNAM(sc),
-	    sc->sc_rx_bufsz, sc->sc_tx_bufsz);
+	DPRINTFN(2, "%s: rx/tx size %d/%d%s\n", DEVNAM(sc),
+	    sc->sc_rx_bufsz, sc->sc_tx_bufsz,
+	    (sc->sc_flags & UMBFLG_NTB32) ? " (NTB32)" : "");
 
 	s = splnet();
 
@@ -522,7 +752,17 @@ umb_attach(device_t dev)
 	ifp->if_softc = sc;
 	ifp->if_flags = IFF_SIMPLEX | IFF_MULTICAST | IFF_POINTOPOINT;
 	ifp->if_ioctl = umb_ioctl;
-	ifp->if_start = umb_start;
+	ifp->if_transmit = umb_transmit;
+	ifp->if_qflush = umb_qflush;
+#ifdef INET
+	/*
+	 * Checksums and TSO are done in software, see umb_encap(), and
+	 * so is LRO, see umb_gro_input()
+	 */
+	ifp->if_capabilities = IFCAP_TXCSUM | IFCAP_TSO4 | IFCAP_LRO;
+	ifp->if_capenable = ifp->if_capabilities;
+	ifp->if_hwassist = CSUM_TCP | CSUM_TSO;
+#endif
 
 	ifp->if_watchdog = umb_watchdog;
 	strlcpy(ifp->if_xname, device_xname(sc->sc_dev), IFNAMSIZ);
@@ -537,7 +777,6 @@ umb_attach(device_t dev)
 	ifp->if_mtu = sc->sc_maxpktlen;
 	ifp->if_output = umb_output;
 	ifp->_if_input = umb_input;
-	IFQ_SET_READY(&ifp->if_snd);
 
 	/* attach the interface */
 	rv = if_initialize(ifp);
@@ -577,7 +816,7 @@ umb_detach(device_t dev)
 {
 	struct umb_softc *sc = device_get_softc(dev);
 	struct ifnet *ifp = GET_IFP(sc);
-	int	 s;
+	int	 i, s;
 
 	pmf_device_deregister(self);
 
@@ -591,8 +830,16 @@ umb_detach(device_t dev)
 	sc->sc_nresp = 0;
 	if (sc->sc_rx_ep != -1 && sc->sc_tx_ep != -1) {
 		callout_destroy(&sc->sc_statechg_timer);
+		callout_drain(&sc->sc_tx_timer);
+		callout_drain(&sc->sc_tx_shape_timer);
+		callout_drain(&sc->sc_stats_timer);
 		usb_rem_task(sc->sc_udev, &sc->sc_umb_task);
 		usb_wait_task(sc->sc_udev, &sc->sc_umb_task);
+		if (sc->sc_rx_tq != NULL) {
+			taskqueue_drain(sc->sc_rx_tq, &sc->sc_rx_task);
+			taskqueue_free(sc->sc_rx_tq);
+			sc->sc_rx_tq = NULL;
+		}
 	}
 	if (sc->sc_ctrl_pipe) {
 		usbd_close_pipe(sc->sc_ctrl_pipe);
@@ -613,6 +860,16 @@ umb_detach(device_t dev)
 		bpf_detach(ifp);
 		if_detach(ifp);
 	}
+	if (sc->sc_tx_br[0] != NULL) {
+		umb_tx_purge(sc);
+		for (i = 0; i < UMB_TX_NLANES; i++) {
+			buf_ring_free(sc->sc_tx_br[i], M_USB_UMB);
+			sc->sc_tx_br[i] = NULL;
+		}
+		mtx_destroy(&sc->sc_rx_mtx);
+		mtx_destroy(&sc->sc_ackf_mtx);
+		mtx_destroy(&sc->sc_tx_mtx);
+	}
 
 	sc->sc_attached = 0;
 	splx(s);
@@ -639,6 +896,7 @@ umb_ncm_setup(struct umb_softc *sc)
 {
 	usb_device_request_t req;
 	struct ncm_ntb_parameters np;
+	int	 n, align;
 
 	/* Query NTB tranfers sizes */
 	req.bmRequestType = UT_READ_CLASS_INTERFACE;
@@ -648,32 +906,186 @@ umb_ncm_setup(struct umb_softc *sc)
 	USETW(req.wLength, sizeof(np));
 	if (usbd_do_request(sc->sc_udev, &req, &np) == USBD_NORMAL_COMPLETION &&
 	    UGETW(np.wLength) == sizeof(np)) {
-		sc->sc_rx_bufsz = UGETDW(np.dwNtbInMaxSize);
-		sc->sc_tx_bufsz = UGETDW(np.dwNtbOutMaxSize);
-	} else
+		sc->sc_rx_devmax = MIN(UGETDW(np.dwNtbInMaxSize), INT_MAX);
+		if (sc->sc_rx_devmax < UMB_NTB_MINSIZE)
+			sc->sc_rx_devmax = UMB_NTB_MINSIZE;
+		sc->sc_tx_bufsz = sc->sc_tx_ntbmax =
+		    UGETDW(np.dwNtbOutMaxSize);
+
+		/* A value of zero means "no limit" */
+		n = UGETW(np.wNtbOutMaxDatagrams);
+		if (n == 0 || n > UMB_TX_MAXDGRAMS)
+			n = UMB_TX_MAXDGRAMS;
+		sc->sc_tx_maxdgrams = n;
+
+		/*
+		 * Datagrams should start at an offset that leaves
+		 * wNtbOutPayloadRemainder when divided by wNtbOutDivisor,
+		 * NDPs at a multiple of wNtbOutAlignment. Ignore values
+		 * that make no sense or would waste too much space.
+		 */
+		sc->sc_tx_div = UGETW(np.wNtbOutDivisor);
+		sc->sc_tx_rem = UGETW(np.wNtbOutPayloadRemainder);
+		if (sc->sc_tx_div < sizeof(uint32_t) ||
+		    sc->sc_tx_div > UMB_NTB_MAXALIGN)
+			sc->sc_tx_div = sizeof(uint32_t);
+		if (sc->sc_tx_rem >= sc->sc_tx_div)
+			sc->sc_tx_rem = 0;
+		align = UGETW(np.wNtbOutAlignment);
+		if (align < sizeof(uint32_t) || align > UMB_NTB_MAXALIGN ||
+		    !powerof2(align))
+			align = sizeof(uint32_t);
+
+		/*
+		 * NTB16 is the default. Only switch to NTB32 if the device
+		 * accepts out-NTBs that an NTH16 cannot describe.
+		 */
+		if ((UGETW(np.bmNtbFormatsSupported) & NCM_FORMAT_NTB32) &&
+		    sc->sc_tx_bufsz > 0xffff) {
+			req.bmRequestType = UT_WRITE_CLASS_INTERFACE;
+			req.bRequest = NCM_SET_NTB_FORMAT;
+			USETW(req.wValue, NCM_NTB_FORMAT_32);
+			USETW(req.wIndex, sc->sc_ctrl_ifaceno);
+			USETW(req.wLength, 0);
+			if (usbd_do_request(sc->sc_udev, &req, NULL) ==
+			    USBD_NORMAL_COMPLETION)
+				sc->sc_flags |= UMBFLG_NTB32;
+			else
+				DPRINTF("%s: failed to select NTB32 format\n",
+				    DEVNAM(sc));
+		}
+
+		/*
+		 * Some devices start out with small in-NTBs, so ask for
+		 * the size we want. It may not exceed what the device
+		 * takes, nor UMB_NTB_MAXSIZE, nor what the format can
+		 * describe.
+		 */
+		sc->sc_rx_ntbmax = MIN(sc->sc_rx_devmax, UMB_NTB_MAXSIZE);
+		if (!(sc->sc_flags & UMBFLG_NTB32) &&
+		    sc->sc_rx_ntbmax > 0xffff)
+			sc->sc_rx_ntbmax = 0xffff;
+		n = sc->sc_rx_ntbmax;
+		if (umb_rx_ntbsize > 0)
+			n = MIN(MAX(umb_rx_ntbsize, UMB_NTB_MINSIZE), n);
+		sc->sc_rx_bufsz = umb_ncm_insize(sc, n);
+	} else {
 		sc->sc_rx_bufsz = sc->sc_tx_bufsz = 8 * 1024;
+		sc->sc_rx_devmax = sc->sc_rx_ntbmax = sc->sc_rx_bufsz;
+		/* Not known, so always end NTBs with a short packet */
+		sc->sc_tx_ntbmax = UINT32_MAX;
+		sc->sc_tx_maxdgrams = 1;
+		sc->sc_tx_div = sizeof(uint32_t);
+		sc->sc_tx_rem = 0;
+		align = sizeof(uint32_t);
+	}
+	sc->sc_info.rx_ntbsize = sc->sc_rx_bufsz;
+	sc->sc_info.rx_ntbmax = sc->sc_rx_devmax;
+	sc->sc_tx_ndpoffs = roundup((sc->sc_flags & UMBFLG_NTB32) ?
+	    sizeof(struct ncm_header32) : sizeof(struct ncm_header16), align);
+
+	if (sc->sc_tx_bufsz > UMB_NTB_MAXSIZE)
+		sc->sc_tx_bufsz = UMB_NTB_MAXSIZE;
+	/* wBlockLength of an NTH16 cannot describe anything larger */
+	if (!(sc->sc_flags & UMBFLG_NTB32) && sc->sc_tx_bufsz > 0xffff)
+		sc->sc_tx_bufsz = 0xffff;
+}
+
+/*
+ * Ask for in-NTBs of the given size and return the size the device
+ * settled on, which receive buffers must hold. A device that refuses
+ * the request may send NTBs of anything up to its dwNtbInMaxSize,
+ * however large, unless it tells us otherwise.
+ */
+static int
+umb_ncm_insize(struct umb_softc *sc, int size)
+{
+	usb_device_request_t req;
+	struct ncm_ntb_input_size is;
+	int	 len, n;
+
+	len = (sc->sc_flags & UMBFLG_NTBINPUTSIZE8) ?
+	    sizeof(is) : sizeof(is.dwNtbInMaxSize);
+	memset(&is, 0, sizeof(is));
+	USETDW(is.dwNtbInMaxSize, size);
+	req.bmRequestType = UT_WRITE_CLASS_INTERFACE;
+	req.bRequest = NCM_SET_NTB_INPUT_SIZE;
+	USETW(req.wValue, 0);
+	USETW(req.wIndex, sc->sc_ctrl_ifaceno);
+	USETW(req.wLength, len);
+	if (usbd_do_request(sc->sc_udev, &req, &is) != USBD_NORMAL_COMPLETION) {
+		DPRINTF("%s: failed to set in-NTB size %d\n", DEVNAM(sc),
+		    size);
+		size = sc->sc_rx_devmax;
+	}
+
+	/* Trust what the device reports back, within its own limit */
+	req.bmRequestType = UT_READ_CLASS_INTERFACE;
+	req.bRequest = NCM_GET_NTB_INPUT_SIZE;
+	if (usbd_do_request(sc->sc_udev, &req, &is) ==
+	    USBD_NORMAL_COMPLETION) {
+		n = UGETDW(is.dwNtbInMaxSize);
+		if (n >= UMB_NTB_MINSIZE && n <= sc->sc_rx_devmax)
+			size = n;
+	}
+	DPRINTFN(2, "%s: in-NTB size %d\n", DEVNAM(sc), size);
+	return size;
 }
 
 static int
 umb_alloc_xfers(struct umb_softc *sc)
 {
+	struct umb_rx *rx;
+	struct umb_tx *tx;
 	int err = 0;
+	int i;
 
-	if (!sc->sc_rx_xfer) {
-		err |= usbd_create_xfer(sc->sc_rx_pipe,
-		    sc->sc_rx_bufsz,
-		    0, 0, &sc->sc_rx_xfer);
+	if (!sc->sc_rx_list[0].rx_xfer) {
+		sc->sc_rx_cnt = umb_rx_list_cnt;
+		if (sc->sc_rx_cnt < 1)
+			sc->sc_rx_cnt = 1;
+		else if (sc->sc_rx_cnt > UMB_RX_LIST_MAX)
+			sc->sc_rx_cnt = UMB_RX_LIST_MAX;
+		if (umb_rx_zerocopy && sc->sc_rxpool == NULL)
+			sc->sc_rxpool = umb_rxpool_create(sc->sc_rx_bufsz);
+		sc->sc_info.rx_zerocopy = sc->sc_rxpool != NULL;
+	}
+	for (i = 0; i < sc->sc_rx_cnt; i++) {
+		rx = &sc->sc_rx_list[i];
+		rx->rx_sc = sc;
+		if (!rx->rx_xfer) {
+			err |= usbd_create_xfer(sc->sc_rx_pipe,
+			    sc->sc_rx_bufsz,
+			    0, 0, &rx->rx_xfer);
+		}
 	}
-	if (!sc->sc_tx_xfer) {
-		err |= usbd_create_xfer(sc->sc_tx_pipe,
-		    sc->sc_tx_bufsz,
-		    0, 0, &sc->sc_tx_xfer);
+	if (!sc->sc_tx_list[0].tx_xfer) {
+		sc->sc_tx_cnt = umb_tx_list_cnt;
+		if (sc->sc_tx_cnt < 1)
+			sc->sc_tx_cnt = 1;
+		else if (sc->sc_tx_cnt > UMB_TX_LIST_MAX)
+			sc->sc_tx_cnt = UMB_TX_LIST_MAX;
+	}
+	for (i = 0; i < sc->sc_tx_cnt; i++) {
+		tx = &sc->sc_tx_list[i];
+		tx->tx_sc = sc;
+		if (!tx->tx_xfer) {
+			err |= usbd_create_xfer(sc->sc_tx_pipe,
+			    sc->sc_tx_bufsz,
+			    0, 0, &tx->tx_xfer);
+		}
 	}
 	if (err)
 		return err;
 
-	sc->sc_rx_buf = usbd_get_buffer(sc->sc_rx_xfer);
-	sc->sc_tx_buf = usbd_get_buffer(sc->sc_tx_xfer);
+	for (i = 0; i < sc->sc_rx_cnt; i++) {
+		rx = &sc->sc_rx_list[i];
+		rx->rx_buf = usbd_get_buffer(rx->rx_xfer);
+	}
+	for (i = 0; i < sc->sc_tx_cnt; i++) {
+		tx = &sc->sc_tx_list[i];
+		tx->tx_buf = usbd_get_buffer(tx->tx_xfer);
+	}
 
 	return 0;
 }
@@ -681,30 +1093,52 @@ umb_alloc_xfers(struct umb_softc *sc)
 static void
 umb_free_xfers(struct umb_softc *sc)
 {
-	if (sc->sc_rx_xfer) {
-		/* implicit usbd_free_buffer() */
-		usbd_destroy_xfer(sc->sc_rx_xfer);
-		sc->sc_rx_xfer = NULL;
-		sc->sc_rx_buf = NULL;
+	struct umb_rx *rx;
+	struct umb_tx *tx;
+	int i;
+
+	for (i = 0; i < UMB_RX_LIST_MAX; i++) {
+		rx = &sc->sc_rx_list[i];
+		if (rx->rx_xfer) {
+			/* implicit usbd_free_buffer() */
+			usbd_destroy_xfer(rx->rx_xfer);
+			rx->rx_xfer = NULL;
+			rx->rx_buf = NULL;
+		}
+		if (rx->rx_rb) {
+			umb_rxbuf_put(rx->rx_rb);
+			rx->rx_rb = NULL;
+		}
 	}
-	if (sc->sc_tx_xfer) {
-		usbd_destroy_xfer(sc->sc_tx_xfer);
-		sc->sc_tx_xfer = NULL;
-		sc->sc_tx_buf = NULL;
+	if (sc->sc_rxpool) {
+		umb_rxpool_destroy(sc->sc_rxpool);
+		sc->sc_rxpool = NULL;
 	}
-	if (sc->sc_tx_m) {
-		m_freem(sc->sc_tx_m);
-		sc->sc_tx_m = NULL;
+	for (i = 0; i < UMB_TX_LIST_MAX; i++) {
+		tx = &sc->sc_tx_list[i];
+		if (tx->tx_xfer) {
+			usbd_destroy_xfer(tx->tx_xfer);
+			tx->tx_xfer = NULL;
+			tx->tx_buf = NULL;
+		}
+		if (tx->tx_m) {
+			umb_tx_freem(tx->tx_m);
+			tx->tx_m = NULL;
+		}
 	}
+	sc->sc_tx_prod = sc->sc_tx_cons = sc->sc_tx_busy = 0;
+	sc->sc_tx_nbytes = 0;
 }
 
 static int
 umb_alloc_bulkpipes(struct umb_softc *sc)
 {
 	struct ifnet *ifp = GET_IFP(sc);
-	int rv;
+	int rv, i;
 
 	if (!(ifp->if_flags & IFF_RUNNING)) {
+		if (umb_rx_ntbconnect)
+			umb_rx_connect_ntbsize(sc);
 		if ((rv = usbd_open_pipe(sc->sc_data_iface, sc->sc_rx_ep,
 		    USBD_EXCLUSIVE_USE, &sc->sc_rx_pipe))) {
 			DPRINTFN(4, "usbd_open_pipe() failed (RX) %d\n", rv);
@@ -721,9 +1155,23 @@ umb_alloc_bulkpipes(struct umb_softc *sc)
 			return 0;
 		}
 
+		mtx_lock(&sc->sc_tx_mtx);
+		sc->sc_tx_prod = sc->sc_tx_cons = sc->sc_tx_busy = 0;
+		sc->sc_tx_nbytes = 0;
+		sc->sc_tx_lastdone = 0;
+		sc->sc_tx_flush = 0;
+		sc->sc_info.tx_bql_limit =
+		    umb_tx_bql_target > 0 ? UMB_TX_BQL_MAX : 0;
 		ifp->if_flags |= IFF_RUNNING;
 		ifp->if_flags &= ~IFF_OACTIVE;
-		umb_rx(sc);
+		mtx_unlock(&sc->sc_tx_mtx);
+
+		/* Keep all of the ring posted, so the device can go on */
+		sc->sc_rx_adapt_up = getsbinuptime();
+		sc->sc_rx_posted = 0;
+		sc->sc_info.rx_ring = sc->sc_rx_cnt;
+		for (i = 0; i < sc->sc_rx_cnt; i++)
+			umb_rx(sc, &sc->sc_rx_list[i]);
 	}
 	return 1;
 }
@@ -733,8 +1181,27 @@ umb_close_bulkpipes(struct umb_softc *sc)
 {
 	struct ifnet *ifp = GET_IFP(sc);
 
+	/* Wait for a running umb_start_locked() */
+	mtx_lock(&sc->sc_tx_mtx);
 	ifp->if_flags &= ~(IFF_RUNNING | IFF_OACTIVE);
 	ifp->if_timer = 0;
+	mtx_unlock(&sc->sc_tx_mtx);
+	callout_stop(&sc->sc_tx_timer);
+	callout_stop(&sc->sc_tx_shape_timer);
+	callout_stop(&sc->sc_stats_timer);
+
+	/*
+	 * Drop the NTBs queued for the poll task and let a pass that
+	 * is still busy with one finish, while the pipe it reposts on
+	 * is open.
+	 */
+	mtx_lock(&sc->sc_rx_mtx);
+	STAILQ_INIT(&sc->sc_rx_pollq);
+	sc->sc_rx_polling = sc->sc_info.rx_polling = 0;
+	mtx_unlock(&sc->sc_rx_mtx);
+	if (sc->sc_rx_tq != NULL)
+		taskqueue_drain(sc->sc_rx_tq, &sc->sc_rx_task);
+
 	if (sc->sc_rx_pipe) {
 		usbd_close_pipe(sc->sc_rx_pipe);
 		sc->sc_rx_pipe = NULL;
@@ -743,6 +1210,10 @@ umb_close_bulkpipes(struct umb_softc *sc)
 		usbd_close_pipe(sc->sc_tx_pipe);
 		sc->sc_tx_pipe = NULL;
 	}
+	if (sc->sc_rx_adapt_up != 0) {
+		sc->sc_rx_adapt_time += getsbinuptime() - sc->sc_rx_adapt_up;
+		sc->sc_rx_adapt_up = 0;
+	}
 }
 
 static int
@@ -751,7 +1222,7 @@ umb_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 	struct umb_softc *sc = ifp->if_softc;
 	struct ifaddr *ifa = (struct ifaddr *)data;
 	struct ifreq *ifr = (struct ifreq *)data;
-	int s, error = 0;
+	int s, mask, error = 0;
 	struct umb_parameter mp;
 
 	if (sc->sc_dying)
@@ -784,6 +1255,7 @@ umb_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 		usb_add_task(sc->sc_udev, &sc->sc_umb_task, USB_TASKQ_DRIVER);
 		break;
 	case SIOCGUMBINFO:
+		umb_tx_fq_stats(sc);
 		error = copyout(&sc->sc_info, ifr->ifr_data,
 		    sizeof(sc->sc_info));
 		break;
@@ -806,6 +1278,14 @@ umb_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 			error = EINVAL;
 			break;
 		}
+		if (mp.txholdtime < 0 || mp.txholdtime > UMB_TX_MAXHOLD) {
+			error = EINVAL;
+			break;
+		}
+		if (mp.txshape < 0 || mp.txshape > UMB_TX_MAXSHAPE) {
+			error = EINVAL;
+			break;
+		}
 		sc->sc_roaming = mp.roaming ? 1 : 0;
 		memset(sc->sc_info.apn, 0, sizeof(sc->sc_info.apn));
 		memcpy(sc->sc_info.apn, mp.apn, mp.apnlen);
@@ -818,6 +1298,18 @@ umb_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 		sc->sc_info.passwordlen = mp.passwordlen;
 		sc->sc_info.preferredclasses = mp.preferredclasses;
 		umb_setdataclass(sc);
+		sc->sc_info.tx_holdtime = mp.txholdtime;
+		sc->sc_info.tx_ackfilter = mp.ackfilter ? 1 : 0;
+		sc->sc_info.tx_fqcodel = mp.fqcodel ? 1 : 0;
+		sc->sc_info.tx_shape = mp.txshape;
+		sc->sc_info.tx_autorate = mp.autorate ? 1 : 0;
+		if (sc->sc_info.compress != (mp.compression ? 1 : 0)) {
+			sc->sc_info.compress = mp.compression ? 1 : 0;
+			/* Ask again on the next connect */
+			if (sc->sc_info.compression == UMB_COMPRESSION_REJECTED)
+				sc->sc_info.compression = UMB_COMPRESSION_OFF;
+		}
+		umb_tx_shape_update(sc);
 		break;
 	case SIOCGUMBPARAM:
 		memset(&mp, 0, sizeof(mp));
@@ -825,6 +1317,12 @@ umb_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 		mp.apnlen = sc->sc_info.apnlen;
 		mp.roaming = sc->sc_roaming;
 		mp.preferredclasses = sc->sc_info.preferredclasses;
+		mp.txholdtime = sc->sc_info.tx_holdtime;
+		mp.ackfilter = sc->sc_info.tx_ackfilter;
+		mp.fqcodel = sc->sc_info.tx_fqcodel;
+		mp.txshape = sc->sc_info.tx_shape;
+		mp.autorate = sc->sc_info.tx_autorate;
+		mp.compression = sc->sc_info.compress;
 		error = copyout(&mp, ifr->ifr_data, sizeof(mp));
 		break;
 	case SIOCSIFMTU:
@@ -835,6 +1333,24 @@ umb_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 		}
 		ifp->if_mtu = ifr->ifr_mtu;
 		break;
+	case SIOCSIFCAP:
+		mask = (ifr->ifr_reqcap ^ ifp->if_capenable) &
+		    ifp->if_capabilities;
+		if (mask & IFCAP_TXCSUM)
+			ifp->if_capenable ^= IFCAP_TXCSUM;
+		if (mask & IFCAP_TSO4)
+			ifp->if_capenable ^= IFCAP_TSO4;
+		if (mask & IFCAP_LRO)
+			ifp->if_capenable ^= IFCAP_LRO;
+		/* TSO needs the TCP checksum computed per segment */
+		if (!(ifp->if_capenable & IFCAP_TXCSUM))
+			ifp->if_capenable &= ~IFCAP_TSO4;
+		ifp->if_hwassist = 0;
+		if (ifp->if_capenable & IFCAP_TXCSUM)
+			ifp->if_hwassist |= CSUM_TCP;
+		if (ifp->if_capenable & IFCAP_TSO4)
+			ifp->if_hwassist |= CSUM_TSO;
+		break;
 	case SIOCSIFADDR:
 	case SIOCAIFADDR:
 	case SIOCSIFDSTADDR:
@@ -856,155 +1372,806 @@ static int
 umb_output(struct ifnet *ifp, struct mbuf *m, const struct sockaddr *dst,
     const struct rtentry *rtp)
 {
-	int error;
+	struct umb_softc *sc = ifp->if_softc;
+	sbintime_t now, last;
+	int64_t gap;
+	u_int	 ogap;
 
 	DPRINTFN(10, "%s: %s: enter\n",
 		     device_xname(((struct umb_softc *)ifp->if_softc)->sc_dev),
 		     __func__);
 
 	/*
-	 * if the queueing discipline needs packet classification,
-	 * do it now.
-	 */
-	IFQ_CLASSIFY(&ifp->if_snd, m, dst->sa_family);
-
-	/*
-	 * Queue message on interface, and start output if interface
-	 * not yet active.
+	 * Track the packet arrival rate for the TX coalescing timer.
+	 * Senders on other CPUs update it concurrently and without
+	 * sc_tx_mtx. A sender that read the clock earlier may swap in
+	 * its time after ours, so the gap can come out negative.
 	 */
-	error = if_transmit_lock(ifp, m);
+	if (sc->sc_info.tx_holdtime > 0) {
+		now = getsbinuptime();
+		last = atomic_swap_64((volatile uint64_t *)&sc->sc_tx_last,
+		    now);
+		gap = (now - last) / SBT_1US;
+		if (gap < 0)
+			gap = 0;
+		else if (gap > UMB_TX_MAXHOLD)
+			gap = UMB_TX_MAXHOLD;
+		do {
+			ogap = atomic_load_int(&sc->sc_tx_gap);
+		} while (!atomic_cmpset_int(&sc->sc_tx_gap, ogap,
+		    (7 * ogap + gap) / 8));
+	}
 
-	return error;
+	return ifp->if_transmit(ifp, m);
 }
 
-static void
-umb_input(struct ifnet *ifp, struct mbuf *m)
+/*
+ * Producers only put packets on the buf_rings. Whoever gets sc_tx_mtx
+ * drains them into NTBs; a producer that finds the lock taken leaves its
+ * packet to the holder, which looks at the rings again after unlocking.
+ */
+static int
+umb_transmit(struct ifnet *ifp, struct mbuf *m)
 {
-	size_t pktlen = m->m_len;
-	int s;
+	struct umb_softc *sc = ifp->if_softc;
+	int	 error, lane, len;
 
-	if ((ifp->if_flags & IFF_UP) == 0) {
-		m_freem(m);
-		return;
+#ifdef INET
+	/*
+	 * Checksum plain packets here, on the sending CPU. TSO packets
+	 * are split and checksummed while being copied into the NTB.
+	 */
+	if (m->m_pkthdr.csum_flags & CSUM_TSO) {
+		if ((m = umb_tso_prepare(m)) == NULL) {
+			if_inc_counter(ifp, IFCOUNTER_OERRORS, 1);
+			return EINVAL;
+		}
+	} else if (m->m_pkthdr.csum_flags & CSUM_DELAY_DATA) {
+		in_delayed_cksum(m);
+		m->m_pkthdr.csum_flags &= ~CSUM_DELAY_DATA;
 	}
-	if (pktlen < sizeof(struct ip)) {
-		ifp->if_ierrors++;
-		DPRINTFN(4, "%s: dropping short packet (len %zd)\n", __func__,
-		    pktlen);
+#endif
+
+	lane = umb_tx_classify(m);
+
+	/*
+	 * Byte queue limit: keep no more data queued and in flight than
+	 * the link drains in umb_tx_bql_target. One packet is always
+	 * let through, so a small limit cannot stall the interface.
+	 * Priority packets are small and exempt.
+	 */
+	len = m->m_pkthdr.len;
+	if (lane != UMB_TX_LANE_PRIO && sc->sc_info.tx_bql_limit > 0 &&
+	    sc->sc_tx_qbytes + sc->sc_tx_nbytes > 0 &&
+	    sc->sc_tx_qbytes + sc->sc_tx_nbytes + len >
+	    sc->sc_info.tx_bql_limit) {
+		atomic_add_64(&sc->sc_info.tx_bql_hits, 1);
+		atomic_add_64(&sc->sc_info.tx_lane_drops[lane], 1);
+		if_inc_counter(ifp, IFCOUNTER_OQDROPS, 1);
 		m_freem(m);
-		return;
+		return ENOBUFS;
 	}
-	s = splnet();
-	if (__predict_false(!pktq_enqueue(ip_pktq, m, 0))) {
-		ifp->if_iqdrops++;
+
+	if ((error = umb_tx_enqueue(sc, lane, m)) != 0)
+		return error;
+
+	if (mtx_trylock(&sc->sc_tx_mtx))
+		umb_tx_unlock(sc, umb_start_locked(sc));
+	return 0;
+}
+
+/*
+ * Put a packet on the ring of its lane, or drop it if that is full.
+ */
+static int
+umb_tx_enqueue(struct umb_softc *sc, int lane, struct mbuf *m)
+{
+	struct ifnet *ifp = GET_IFP(sc);
+	int	 error, len;
+
+	len = m->m_pkthdr.len;
+	UMB_TX_STAMP(m) = getsbinuptime();
+	atomic_add_int(&sc->sc_tx_qbytes, len);
+	if (sc->sc_info.tx_ackfilter)
+		error = umb_ackf_enqueue(sc, sc->sc_tx_br[lane], m);
+	else
+		error = buf_ring_enqueue(sc->sc_tx_br[lane], m);
+	if (error) {
+		atomic_subtract_int(&sc->sc_tx_qbytes, len);
+		atomic_add_64(&sc->sc_info.tx_lane_drops[lane], 1);
+		if_inc_counter(ifp, IFCOUNTER_OQDROPS, 1);
 		m_freem(m);
-	} else {
-		ifp->if_ipackets++;
-		ifp->if_ibytes += pktlen;
 	}
-	splx(s);
+	return error;
 }
 
 static void
-umb_start(struct ifnet *ifp)
+umb_qflush(struct ifnet *ifp)
 {
 	struct umb_softc *sc = ifp->if_softc;
-	struct mbuf *m_head = NULL;
 
-	if (sc->sc_dying || (ifp->if_flags & IFF_OACTIVE))
-		return;
+	mtx_lock(&sc->sc_tx_mtx);
+	umb_tx_purge(sc);
+	mtx_unlock(&sc->sc_tx_mtx);
+	if_qflush(ifp);
+}
 
-	IFQ_POLL(&ifp->if_snd, m_head);
-	if (m_head == NULL)
-		return;
+static void
+umb_tx_purge(struct umb_softc *sc)
+{
+	struct mbuf *m;
+	int	 i;
 
-	if (!umb_encap(sc, m_head)) {
-		ifp->if_flags |= IFF_OACTIVE;
-		return;
+	/*
+	 * Every ACK recorded with the ACK filter is forgotten as it is
+	 * freed, so the slots stay balanced against producers that keep
+	 * enqueueing meanwhile.
+	 */
+	sc->sc_tx_tsom = NULL;
+	for (i = 0; i < UMB_TX_NLANES; i++) {
+		while ((m = buf_ring_dequeue_sc(sc->sc_tx_br[i])) != NULL) {
+			atomic_subtract_int(&sc->sc_tx_qbytes,
+			    m->m_pkthdr.len);
+			(void)umb_ackf_obsolete(sc, m);
+			m_freem(m);
+		}
 	}
-	IFQ_DEQUEUE(&ifp->if_snd, m_head);
-
-	bpf_mtap(ifp, m_head, BPF_D_OUT);
 
-	ifp->if_flags |= IFF_OACTIVE;
-	ifp->if_timer = (2 * umb_xfer_tout) / 1000;
+	for (i = 0; i < UMB_FQ_FLOWS; i++) {
+		while ((m = sc->sc_fq.fs_fq[i].fq_head) != NULL) {
+			sc->sc_fq.fs_fq[i].fq_head = m->m_nextpkt;
+			m->m_nextpkt = NULL;
+			atomic_subtract_int(&sc->sc_tx_qbytes,
+			    m->m_pkthdr.len);
+			(void)umb_ackf_obsolete(sc, m);
+			m_freem(m);
+		}
+	}
+	umb_tx_fq_init(sc);
 }
 
-static void
-umb_watchdog(struct ifnet *ifp)
+/*
+ * Small packets (TCP SYN and pure ACKs, DNS queries) and packets with
+ * a high DSCP go to the priority lane. Only the first bytes of the IP
+ * header are looked at.
+ */
+static int
+umb_tx_classify(struct mbuf *m)
 {
-	struct umb_softc *sc = ifp->if_softc;
+	uint8_t	*p;
+	int	 dscp;
+
+	if (m->m_pkthdr.len <= umb_tx_prio_maxlen)
+		return UMB_TX_LANE_PRIO;
+	if (m->m_len < 2)
+		return UMB_TX_LANE_BULK;
+	p = mtod(m, uint8_t *);
+	switch (p[0] >> 4) {
+	case 4:
+		dscp = p[1] >> 2;
+		break;
+	case 6:
+		dscp = ((p[0] & 0x0f) << 2) | (p[1] >> 6);
+		break;
+	default:
+		return UMB_TX_LANE_BULK;
+	}
+	return dscp >= UMB_TX_PRIO_DSCP ? UMB_TX_LANE_PRIO : UMB_TX_LANE_BULK;
+}
 
-	if (sc->sc_dying)
-		return;
+/* Next packet to send, the priority lane first */
+static struct mbuf *
+umb_tx_peek(struct umb_softc *sc, int *lane)
+{
+	struct mbuf *m;
+	int	 i;
 
-	ifp->if_oerrors++;
-	printf("%s: watchdog timeout\n", DEVNAM(sc));
-	usbd_abort_pipe(sc->sc_tx_pipe);
-	return;
+	for (i = 0; i < UMB_TX_NLANES; i++) {
+		if (i == UMB_TX_LANE_BULK &&
+		    (sc->sc_info.tx_fqcodel || sc->sc_fq.fs_qlen > 0))
+			m = umb_tx_fq_peek(sc);
+		else
+			m = buf_ring_peek(sc->sc_tx_br[i]);
+		if (m != NULL) {
+			*lane = i;
+			return m;
+		}
+	}
+	return NULL;
 }
 
+/* Remove the packet returned by umb_tx_peek() */
 static void
-umb_statechg_timeout(void *arg)
+umb_tx_dequeue(struct umb_softc *sc, int lane, struct mbuf *m)
 {
-	struct umb_softc *sc = arg;
+	uint64_t delay;
 
-	if (sc->sc_info.regstate == MBIM_REGSTATE_ROAMING && !sc->sc_roaming) {
-		/*
-		 * Query the registration state until we're with the home
-		 * network again.
-		 */
-		umb_cmd(sc, MBIM_CID_REGISTER_STATE, MBIM_CMDOP_QRY, NULL, 0);
-	} else
-		printf("%s: state change timeout\n",DEVNAM(sc));
-	usb_add_task(sc->sc_udev, &sc->sc_umb_task, USB_TASKQ_DRIVER);
+	if (lane == UMB_TX_LANE_BULK && sc->sc_fq.fs_cur != NULL)
+		umb_fq_remove(&sc->sc_fq, m);
+	else
+		buf_ring_advance_sc(sc->sc_tx_br[lane]);
+	atomic_subtract_int(&sc->sc_tx_qbytes, m->m_pkthdr.len);
+
+	delay = (getsbinuptime() - UMB_TX_STAMP(m)) / SBT_1US;
+	sc->sc_info.tx_lane_pkts[lane]++;
+	sc->sc_info.tx_lane_delay[lane] += delay;
+	if (delay > sc->sc_info.tx_lane_maxdelay[lane])
+		sc->sc_info.tx_lane_maxdelay[lane] = delay;
 }
 
 static int
-umb_mediachange(struct ifnet * ifp)
+umb_tx_empty(struct umb_softc *sc)
 {
-	return 0;
+	int	 i;
+
+	if (sc->sc_fq.fs_qlen > 0)
+		return 0;
+	for (i = 0; i < UMB_TX_NLANES; i++)
+		if (!buf_ring_empty(sc->sc_tx_br[i]))
+			return 0;
+	return 1;
 }
 
-static void
-umb_mediastatus(struct ifnet * ifp, struct ifmediareq * imr)
+static int
+umb_tx_qlen(struct umb_softc *sc)
 {
-	switch (ifp->if_link_state) {
-	case LINK_STATE_UP:
-		imr->ifm_status = IFM_AVALID | IFM_ACTIVE;
-		break;
-	case LINK_STATE_DOWN:
-		imr->ifm_status = IFM_AVALID;
-		break;
-	default:
-		imr->ifm_status = 0;
-		break;
-	}
+	int	 i, n;
+
+	n = sc->sc_fq.fs_qlen;
+	for (i = 0; i < UMB_TX_NLANES; i++)
+		n += buf_ring_count(sc->sc_tx_br[i]);
+	return n;
 }
 
+/*
+ * FQ-CoDel (umb_fq.c) on the bulk lane. Packets are moved from the
+ * bulk buf_ring to one of UMB_FQ_FLOWS queues by a hash over the
+ * 5-tuple. The enqueue time set in umb_transmit() is used, so the time
+ * spent on the buf_ring counts as well. Runs with sc_tx_mtx held.
+ */
 static void
-umb_newstate(struct umb_softc *sc, enum umb_state newstate, int flags)
+umb_tx_fq_init(struct umb_softc *sc)
 {
-	struct ifnet *ifp = GET_IFP(sc);
+	umb_fq_init(&sc->sc_fq);
+	sc->sc_fq.fs_drop = umb_tx_fq_drop;
+	sc->sc_fq.fs_arg = sc;
+	sc->sc_fq_seed = arc4random();
+}
 
-	if (newstate == sc->sc_state)
-		return;
-	if (((flags & UMB_NS_DONT_DROP) && newstate < sc->sc_state) ||
-	    ((flags & UMB_NS_DONT_RAISE) && newstate > sc->sc_state))
-		return;
-	if (ifp->if_flags & IFF_DEBUG)
-		log(LOG_DEBUG, "%s: state going %s from '%s' to '%s'\n",
-		    DEVNAM(sc), newstate > sc->sc_state ? "up" : "down",
-		    umb_istate(sc->sc_state), umb_istate(newstate));
-	sc->sc_state = newstate;
-	usb_add_task(sc->sc_udev, &sc->sc_umb_task, USB_TASKQ_DRIVER);
+static u_int
+umb_fq_hash(struct umb_softc *sc, struct mbuf *m)
+{
+	return umb_flow_hash(m, sc->sc_fq_seed, 0) % UMB_FQ_FLOWS;
 }
 
-static void
-umb_state_task(void *arg)
+/*
+ * Hash over addresses, protocol and ports of a packet. With crc, it
+ * is a CRC32C, which the kernel computes with the CPU's instruction
+ * where there is one.
+ */
+static __inline uint32_t
+umb_hash_buf(const void *p, size_t len, uint32_t h, int crc)
 {
-	struct umb_softc *sc = arg;
-	struct ifnet *ifp = GET_IFP(sc);
+	return crc ? calculate_crc32c(h, p, len) : hash32_buf(p, len, h);
+}
+
+static uint32_t
+umb_flow_hash(struct mbuf *m, uint32_t h, int crc)
+{
+	uint8_t	*p = mtod(m, uint8_t *);
+	uint8_t	 proto;
+	int	 hlen, ports = 1;
+
+	if (m->m_len >= sizeof(struct ip) && (p[0] >> 4) == 4) {
+		hlen = (p[0] & 0x0f) << 2;
+		proto = p[9];
+		h = umb_hash_buf(p + 12, 8, h, crc);
+		/* no ports in fragments */
+		if (((p[6] << 8) | p[7]) & 0x3fff)
+			ports = 0;
+	} else if (m->m_len >= 40 && (p[0] >> 4) == 6) {
+		hlen = 40;
+		proto = p[6];
+		h = umb_hash_buf(p + 8, 32, h, crc);
+	} else
+		return h;
+
+	h = umb_hash_buf(&proto, sizeof(proto), h, crc);
+	if (ports && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+	    m->m_len >= hlen + 4)
+		h = umb_hash_buf(p + hlen, 4, h, crc);
+	return h;
+}
+
+/*
+ * Move the bulk ring to the flows and pick the next packet to send.
+ * The parameters are read again each time, they are sysctls.
+ */
+static struct mbuf *
+umb_tx_fq_peek(struct umb_softc *sc)
+{
+	struct ifnet *ifp = GET_IFP(sc);
+	struct umb_fqs *fs = &sc->sc_fq;
+	struct mbuf *m;
+
+	if (fs->fs_cur != NULL)
+		return fs->fs_cur->fq_head;
+
+	fs->fs_quantum = ifp->if_mtu;
+	fs->fs_limit = umb_fq_limit;
+	fs->fs_target = umb_fq_target;
+	fs->fs_interval = umb_fq_interval;
+	if (sc->sc_info.tx_fqcodel) {
+		while ((m = buf_ring_dequeue_sc(
+		    sc->sc_tx_br[UMB_TX_LANE_BULK])) != NULL)
+			umb_fq_enqueue(fs, m, umb_fq_hash(sc, m));
+	}
+	return umb_fq_peek(fs, getsbinuptime() / SBT_1US);
+}
+
+/* A packet dropped by FQ-CoDel */
+static void
+umb_tx_fq_drop(void *arg, struct mbuf *m)
+{
+	struct umb_softc *sc = arg;
+	struct ifnet *ifp = GET_IFP(sc);
+
+	if (m == sc->sc_tx_tsom)
+		sc->sc_tx_tsom = NULL;
+	sc->sc_info.tx_lane_drops[UMB_TX_LANE_BULK]++;
+	atomic_subtract_int(&sc->sc_tx_qbytes, m->m_pkthdr.len);
+	if_inc_counter(ifp, IFCOUNTER_OQDROPS, 1);
+	(void)umb_ackf_obsolete(sc, m);
+	m_freem(m);
+}
+
+/* Copy the counters of the flows to umb_info */
+static void
+umb_tx_fq_stats(struct umb_softc *sc)
+{
+	struct umb_fq_stats *st;
+	struct umb_fq *fq;
+	int	 i;
+
+	mtx_lock(&sc->sc_tx_mtx);
+	for (i = 0; i < UMB_FQ_FLOWS; i++) {
+		fq = &sc->sc_fq.fs_fq[i];
+		st = &sc->sc_info.tx_fq[i];
+		st->pkts = fq->fq_pkts;
+		st->bytes = fq->fq_bytes;
+		st->drops = fq->fq_drops;
+		st->marks = fq->fq_marks;
+		st->qlen = fq->fq_qlen;
+		st->backlog = fq->fq_backlog;
+	}
+	mtx_unlock(&sc->sc_tx_mtx);
+}
+
+/*
+ * Enqueue a packet, recording it with the ACK filter (umb_ackf.c) if
+ * it is a pure ACK. Recorded packets are flagged M_UMB_ACKF.
+ */
+static int
+umb_ackf_enqueue(struct umb_softc *sc, struct buf_ring *br, struct mbuf *m)
+{
+	struct umb_ackf_key key;
+	struct umb_ackf *af;
+	uint32_t ack;
+	int	 error;
+
+	m->m_flags &= ~M_UMB_ACKF;
+	if (!umb_ackf_parse(mtod(m, uint8_t *), m->m_len, m->m_pkthdr.len,
+	    &key, &ack))
+		return buf_ring_enqueue(br, m);
+
+	mtx_lock(&sc->sc_ackf_mtx);
+	if ((af = umb_ackf_slot(sc->sc_ackf, &key)) == NULL) {
+		mtx_unlock(&sc->sc_ackf_mtx);
+		return buf_ring_enqueue(br, m);
+	}
+	m->m_flags |= M_UMB_ACKF;
+	if ((error = buf_ring_enqueue(br, m)) == 0)
+		umb_ackf_add(af, &key, ack);
+	mtx_unlock(&sc->sc_ackf_mtx);
+	return error;
+}
+
+/*
+ * Called for every packet that leaves the send queue, returns 1 if it
+ * is a pure ACK that is superseded by a newer one.
+ */
+static int
+umb_ackf_obsolete(struct umb_softc *sc, struct mbuf *m)
+{
+	struct umb_ackf_key key;
+	uint32_t ack;
+	int	 obsolete;
+
+	if (!(m->m_flags & M_UMB_ACKF))
+		return 0;
+	m->m_flags &= ~M_UMB_ACKF;
+	if (!umb_ackf_parse(mtod(m, uint8_t *), m->m_len, m->m_pkthdr.len,
+	    &key, &ack))
+		return 0;
+
+	mtx_lock(&sc->sc_ackf_mtx);
+	obsolete = umb_ackf_remove(sc->sc_ackf, &key, ack);
+	mtx_unlock(&sc->sc_ackf_mtx);
+	return obsolete;
+}
+
+/*
+ * Pass a chain of datagrams linked by m_nextpkt to IP, one NTB worth
+ * at a time. ip_pktq takes them one by one, but the counters are
+ * updated once for the whole chain.
+ */
+static void
+umb_input(struct ifnet *ifp, struct mbuf *m)
+{
+	struct mbuf *n;
+	size_t	 pktlen, ibytes = 0;
+	u_int	 ipackets = 0, ierrors = 0, iqdrops = 0;
+	int s;
+
+	s = splnet();
+	for (; m != NULL; m = n) {
+		n = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		pktlen = m->m_pkthdr.len;
+		if ((ifp->if_flags & IFF_UP) == 0) {
+			m_freem(m);
+			continue;
+		}
+		if (m->m_len < sizeof(struct ip)) {
+			ierrors++;
+			DPRINTFN(4, "%s: dropping short packet (len %zd)\n",
+			    __func__, pktlen);
+			m_freem(m);
+			continue;
+		}
+		/* Spread flows over CPUs by the hash umb_decap() set */
+		if (__predict_false(!pktq_enqueue(ip_pktq, m,
+		    m->m_pkthdr.flowid))) {
+			iqdrops++;
+			m_freem(m);
+		} else {
+			ipackets++;
+			ibytes += pktlen;
+		}
+	}
+	if_inc_counter(ifp, IFCOUNTER_IPACKETS, ipackets);
+	if_inc_counter(ifp, IFCOUNTER_IBYTES, ibytes);
+	if (ierrors)
+		if_inc_counter(ifp, IFCOUNTER_IERRORS, ierrors);
+	if (iqdrops)
+		if_inc_counter(ifp, IFCOUNTER_IQDROPS, iqdrops);
+	splx(s);
+}
+
+/*
+ * Drain the send ring into NTBs. Returns 1 if it ran dry, 0 if sending
+ * is blocked until a transfer completes or a timer fires.
+ */
+static int
+umb_start_locked(struct umb_softc *sc)
+{
+	struct ifnet *ifp = GET_IFP(sc);
+
+	mtx_assert(&sc->sc_tx_mtx, MA_OWNED);
+	if (sc->sc_dying || !(ifp->if_flags & IFF_RUNNING) ||
+	    (ifp->if_flags & IFF_OACTIVE))
+		return 0;
+
+	/*
+	 * Keep building NTBs while there is a free transfer, so the
+	 * next one is ready before the previous ones have completed.
+	 */
+	while (!umb_tx_empty(sc)) {
+		if (umb_tx_shape(sc) || umb_tx_hold(sc))
+			return 0;
+		if (!umb_encap(sc, &sc->sc_tx_list[sc->sc_tx_prod]))
+			break;
+		/* The held NTB is on its way */
+		sc->sc_tx_flush = 0;
+		ifp->if_timer = (2 * umb_xfer_tout) / 1000;
+		if (sc->sc_tx_busy == sc->sc_tx_cnt) {
+			ifp->if_flags |= IFF_OACTIVE;
+			return 0;
+		}
+	}
+	if (umb_tx_empty(sc)) {
+		callout_stop(&sc->sc_tx_timer);
+		sc->sc_tx_flush = 0;
+	}
+	return 1;
+}
+
+/*
+ * Drop sc_tx_mtx. Packets queued by producers that could not get the
+ * lock in the meantime are sent by whoever gets it next.
+ */
+static void
+umb_tx_unlock(struct umb_softc *sc, int more)
+{
+	for (;;) {
+		mtx_unlock(&sc->sc_tx_mtx);
+		if (!more || umb_tx_empty(sc) ||
+		    !mtx_trylock(&sc->sc_tx_mtx))
+			break;
+		more = umb_start_locked(sc);
+	}
+}
+
+/*
+ * TX coalescing: hold back a partially filled NTB for a short while if
+ * more packets are likely to arrive. The hold time is bounded by the
+ * configured value and by the time it would take to fill the NTB at the
+ * observed arrival rate. Returns 1 if sending should be deferred.
+ */
+static int
+umb_tx_hold(struct umb_softc *sc)
+{
+	struct ifnet *ifp = GET_IFP(sc);
+	int	 gap, hold, qlen;
+
+	hold = sc->sc_info.tx_holdtime;
+	if (hold <= 0 || sc->sc_tx_flush)
+		return 0;
+
+	/* NTB full? */
+	qlen = umb_tx_qlen(sc);
+	if (qlen >= sc->sc_tx_maxdgrams ||
+	    qlen * ifp->if_mtu >= sc->sc_tx_bufsz)
+		return 0;
+
+	/* Next packet not expected in time? */
+	gap = atomic_load_int(&sc->sc_tx_gap);
+	if (gap >= hold)
+		return 0;
+	hold = MIN(hold, gap * (sc->sc_tx_maxdgrams - qlen));
+	if (hold <= 0)
+		return 0;
+
+	if (!callout_pending(&sc->sc_tx_timer))
+		callout_reset_sbt(&sc->sc_tx_timer, hold * SBT_1US, 0,
+		    umb_tx_timeout, sc, 0);
+	return 1;
+}
+
+static void
+umb_tx_timeout(void *arg)
+{
+	struct umb_softc *sc = arg;
+	int	 more = 1;
+
+	mtx_lock(&sc->sc_tx_mtx);
+	if (!umb_tx_empty(sc)) {
+		sc->sc_info.tx_holdflush++;
+		/*
+		 * Stays set until the held NTB has been built, even if
+		 * all transfers are busy now and umb_txeof() has to
+		 * send it.
+		 */
+		sc->sc_tx_flush = 1;
+		more = umb_start_locked(sc);
+	}
+	umb_tx_unlock(sc, more);
+}
+
+/*
+ * Uplink shaper: a token bucket that keeps the rate below the uplink
+ * speed reported by the modem, scaled by the configured percentage,
+ * so that the queue builds up here rather than in the modem. Retuned
+ * whenever the modem reports a new speed. With autorate, that speed
+ * (or UMB_AUTORATE_MAX if unknown) is only the ceiling for the rate
+ * umb_tx_autorate() finds.
+ */
+static void
+umb_tx_shape_update(struct umb_softc *sc)
+{
+	int64_t	 max;
+
+	mtx_lock(&sc->sc_tx_mtx);
+	if (sc->sc_info.tx_autorate) {
+		max = sc->sc_info.uplink_speed / 8 *
+		    (sc->sc_info.tx_shape ? sc->sc_info.tx_shape : 100) / 100;
+		if (max <= 0 || max > UMB_AUTORATE_MAX)
+			max = UMB_AUTORATE_MAX;
+		sc->sc_tx_tbmax = MAX(max, UMB_AUTORATE_MIN);
+		if (sc->sc_tx_tbrate == 0 || sc->sc_tx_tbrate > sc->sc_tx_tbmax)
+			sc->sc_tx_tbrate = sc->sc_tx_tbmax;
+	} else
+		sc->sc_tx_tbrate = sc->sc_info.uplink_speed / 8 *
+		    sc->sc_info.tx_shape / 100;
+	sc->sc_info.tx_shaperate = sc->sc_tx_tbrate * 8;
+	if (sc->sc_tx_tbrate == 0)
+		sc->sc_tx_tokens = 0;
+	mtx_unlock(&sc->sc_tx_mtx);
+}
+
+/*
+ * Returns 1 if the bucket is empty. The NTB that follows may take it
+ * below zero, it is charged in umb_encap().
+ */
+static int
+umb_tx_shape(struct umb_softc *sc)
+{
+	sbintime_t now, dt;
+	int64_t	 burst;
+
+	if (sc->sc_tx_tbrate == 0)
+		return 0;
+
+	now = getsbinuptime();
+	dt = MIN(now - sc->sc_tx_tblast, SBT_1S);
+	sc->sc_tx_tblast = now;
+	sc->sc_tx_tokens += sc->sc_tx_tbrate * dt / SBT_1S;
+	burst = MAX(sc->sc_tx_bufsz, sc->sc_tx_tbrate / 100);
+	if (sc->sc_tx_tokens > burst)
+		sc->sc_tx_tokens = burst;
+	if (sc->sc_tx_tokens >= 0)
+		return 0;
+
+	sc->sc_tx_arlimited = 1;
+	if (!callout_pending(&sc->sc_tx_shape_timer)) {
+		sc->sc_info.tx_shapedelays++;
+		callout_reset_sbt(&sc->sc_tx_shape_timer,
+		    -sc->sc_tx_tokens * SBT_1S / sc->sc_tx_tbrate, 0,
+		    umb_tx_shape_timeout, sc, 0);
+	}
+	return 1;
+}
+
+static void
+umb_tx_shape_timeout(void *arg)
+{
+	struct umb_softc *sc = arg;
+
+	mtx_lock(&sc->sc_tx_mtx);
+	umb_tx_unlock(sc, umb_start_locked(sc));
+}
+
+/*
+ * Delay based autorate. The time from submitting an NTB to its
+ * completion grows once the modem's own buffer fills up and it starts
+ * to hold off the bulk pipe. Its minimum is taken as baseline, which
+ * slowly follows the delay upwards to adapt to path changes. Every
+ * UMB_AUTORATE_INTERVAL the shaper rate is lowered by 1/8 while the
+ * smoothed delay exceeds the baseline by umb_autorate_delay, and
+ * raised by 1/32 while the shaper has been limiting without the delay
+ * going up.
+ */
+static void
+umb_tx_autorate(struct umb_softc *sc, struct umb_tx *tx)
+{
+	sbintime_t now;
+	int64_t	 delay, base, rate;
+
+	if (!sc->sc_info.tx_autorate || sc->sc_tx_tbrate == 0)
+		return;
+
+	now = getsbinuptime();
+	delay = (now - tx->tx_stamp) / SBT_1US;
+	base = sc->sc_info.tx_basedelay;
+	if (base == 0 || delay < base)
+		base = delay;
+	else
+		base += (delay - base) / 256;
+	sc->sc_info.tx_basedelay = base;
+	if (sc->sc_info.tx_delay == 0)
+		sc->sc_info.tx_delay = delay;
+	else
+		sc->sc_info.tx_delay = (7 * sc->sc_info.tx_delay + delay) / 8;
+
+	if ((now - sc->sc_tx_arlast) / SBT_1US < UMB_AUTORATE_INTERVAL)
+		return;
+	sc->sc_tx_arlast = now;
+
+	rate = sc->sc_tx_tbrate;
+	if (sc->sc_info.tx_delay > base + umb_autorate_delay)
+		rate -= rate / 8;
+	else if (sc->sc_tx_arlimited &&
+	    sc->sc_info.tx_delay <= base + umb_autorate_delay / 2)
+		rate += rate / 32;
+	sc->sc_tx_arlimited = 0;
+	rate = MAX(rate, UMB_AUTORATE_MIN);
+	rate = MIN(rate, sc->sc_tx_tbmax);
+	sc->sc_tx_tbrate = rate;
+	sc->sc_info.tx_shaperate = rate * 8;
+}
+
+static void
+umb_watchdog(struct ifnet *ifp)
+{
+	struct umb_softc *sc = ifp->if_softc;
+
+	if (sc->sc_dying)
+		return;
+
+	if_inc_counter(ifp, IFCOUNTER_OERRORS, 1);
+	printf("%s: watchdog timeout\n", DEVNAM(sc));
+	usbd_abort_pipe(sc->sc_tx_pipe);
+	return;
+}
+
+static void
+umb_statechg_timeout(void *arg)
+{
+	struct umb_softc *sc = arg;
+
+	if (sc->sc_info.regstate == MBIM_REGSTATE_ROAMING && !sc->sc_roaming) {
+		/*
+		 * Query the registration state until we're with the home
+		 * network again.
+		 */
+		umb_cmd(sc, MBIM_CID_REGISTER_STATE, MBIM_CMDOP_QRY, NULL, 0);
+	} else
+		printf("%s: state change timeout\n",DEVNAM(sc));
+	usb_add_task(sc->sc_udev, &sc->sc_umb_task, USB_TASKQ_DRIVER);
+}
+
+/*
+ * Poll the modem's packet statistics while the link is up. The query
+ * itself is sent from umb_state_task().
+ */
+static void
+umb_stats_timeout(void *arg)
+{
+	struct umb_softc *sc = arg;
+
+	if (sc->sc_state != UMB_S_UP || umb_stats_interval <= 0)
+		return;
+	sc->sc_stats_due = 1;
+	callout_reset(&sc->sc_stats_timer, umb_stats_interval * hz,
+	    umb_stats_timeout, sc);
+	usb_add_task(sc->sc_udev, &sc->sc_umb_task, USB_TASKQ_DRIVER);
+}
+
+static int
+umb_mediachange(struct ifnet * ifp)
+{
+	return 0;
+}
+
+static void
+umb_mediastatus(struct ifnet * ifp, struct ifmediareq * imr)
+{
+	switch (ifp->if_link_state) {
+	case LINK_STATE_UP:
+		imr->ifm_status = IFM_AVALID | IFM_ACTIVE;
+		break;
+	case LINK_STATE_DOWN:
+		imr->ifm_status = IFM_AVALID;
+		break;
+	default:
+		imr->ifm_status = 0;
+		break;
+	}
+}
+
+static void
+umb_newstate(struct umb_softc *sc, enum umb_state newstate, int flags)
+{
+	struct ifnet *ifp = GET_IFP(sc);
+
+	if (newstate == sc->sc_state)
+		return;
+	if (((flags & UMB_NS_DONT_DROP) && newstate < sc->sc_state) ||
+	    ((flags & UMB_NS_DONT_RAISE) && newstate > sc->sc_state))
+		return;
+	if (ifp->if_flags & IFF_DEBUG)
+		log(LOG_DEBUG, "%s: state going %s from '%s' to '%s'\n",
+		    DEVNAM(sc), newstate > sc->sc_state ? "up" : "down",
+		    umb_istate(sc->sc_state), umb_istate(newstate));
+	sc->sc_state = newstate;
+	usb_add_task(sc->sc_udev, &sc->sc_umb_task, USB_TASKQ_DRIVER);
+}
+
+static void
+umb_state_task(void *arg)
+{
+	struct umb_softc *sc = arg;
+	struct ifnet *ifp = GET_IFP(sc);
 	struct ifreq ifr;
 	int	 s;
 	int	 state;
@@ -1015,6 +2182,13 @@ umb_state_task(void *arg)
 	else
 		umb_down(sc, 0);
 
+	if (sc->sc_stats_due) {
+		sc->sc_stats_due = 0;
+		if (sc->sc_state == UMB_S_UP)
+			umb_cmd(sc, MBIM_CID_PACKET_STATISTICS,
+			    MBIM_CMDOP_QRY, NULL, 0);
+	}
+
 	state = sc->sc_state == UMB_S_UP ? LINK_STATE_UP : LINK_STATE_DOWN;
 	if (ifp->if_link_state != state) {
 		if (ifp->if_flags & IFF_DEBUG)
@@ -1091,6 +2265,13 @@ umb_up(struct umb_softc *sc)
 		if (!umb_alloc_bulkpipes(sc)) {
 			printf("%s: opening bulk pipes failed\n", DEVNAM(sc));
 			umb_down(sc, 1);
+		} else if (umb_stats_interval > 0 &&
+		    !callout_pending(&sc->sc_stats_timer)) {
+			sc->sc_stats_valid = 0;
+			sc->sc_info.link_rxbytes = sc->sc_info.link_txbytes = 0;
+			sc->sc_info.host_rxbytes = sc->sc_info.host_txbytes = 0;
+			/* Queried at the end of this task */
+			umb_stats_timeout(sc);
 		}
 		break;
 	}
@@ -1579,6 +2760,7 @@ umb_decode_packet_service(struct umb_softc *sc, void *data, int len)
 	sc->sc_info.highestclass = highestclass;
 	sc->sc_info.uplink_speed = up_speed;
 	sc->sc_info.downlink_speed = down_speed;
+	umb_tx_shape_update(sc);
 
 	if (sc->sc_info.regmode == MBIM_REGMODE_AUTOMATIC) {
 		/*
@@ -1672,13 +2854,53 @@ umb_decode_connect_info(struct umb_softc *sc, void *data, int len)
 		if (sc->sc_info.activation == MBIM_ACTIVATION_STATE_ACTIVATED)
 			umb_newstate(sc, UMB_S_CONNECTED, UMB_NS_DONT_DROP);
 		else if (sc->sc_info.activation ==
-		    MBIM_ACTIVATION_STATE_DEACTIVATED)
+		    MBIM_ACTIVATION_STATE_DEACTIVATED) {
+			if (sc->sc_info.compression == UMB_COMPRESSION_ON)
+				sc->sc_info.compression = UMB_COMPRESSION_OFF;
 			umb_newstate(sc, UMB_S_ATTACHED, 0);
+		}
 		/* else: other states are purely transitional */
 	}
 	return 1;
 }
 
+/*
+ * The modem counts the bytes on its side of the link, which with
+ * compression may be fewer than the host sent and received. Its
+ * counters may start anywhere, so only their growth between two
+ * reports is added up, next to the growth of the interface counters
+ * over the same time. umb_input() and umb_txeof() bump those with
+ * if_inc_counter(), so they are read back from the same place.
+ */
+static int
+umb_decode_packet_statistics(struct umb_softc *sc, void *data, int len)
+{
+	struct mbim_cid_packet_statistics_info *ps = data;
+	struct ifnet *ifp = GET_IFP(sc);
+	uint64_t in, out, hin, hout;
+
+	if (len < sizeof(*ps))
+		return 0;
+
+	in = le64toh(ps->in_octets);
+	out = le64toh(ps->out_octets);
+	hin = if_get_counter_default(ifp, IFCOUNTER_IBYTES);
+	hout = if_get_counter_default(ifp, IFCOUNTER_OBYTES);
+	if (sc->sc_stats_valid && in >= sc->sc_stats_in &&
+	    out >= sc->sc_stats_out) {
+		sc->sc_info.link_rxbytes += in - sc->sc_stats_in;
+		sc->sc_info.link_txbytes += out - sc->sc_stats_out;
+		sc->sc_info.host_rxbytes += hin - sc->sc_stats_hin;
+		sc->sc_info.host_txbytes += hout - sc->sc_stats_hout;
+	}
+	sc->sc_stats_in = in;
+	sc->sc_stats_out = out;
+	sc->sc_stats_hin = hin;
+	sc->sc_stats_hout = hout;
+	sc->sc_stats_valid = 1;
+	return 1;
+}
+
 static int
 umb_decode_ip_configuration(struct umb_softc *sc, void *data, int len)
 {
@@ -1792,20 +3014,60 @@ done:
 }
 
 static void
-umb_rx(struct umb_softc *sc)
+umb_rx(struct umb_softc *sc, struct umb_rx *rx)
 {
-	usbd_setup_xfer(sc->sc_rx_xfer, sc, sc->sc_rx_buf,
+	usbd_status err;
+	char	*buf = rx->rx_buf;
+
+	/* Without a pool buffer, receive into our own and copy */
+	if (sc->sc_rxpool != NULL) {
+		if (rx->rx_rb == NULL &&
+		    (rx->rx_rb = umb_rxbuf_get(sc->sc_rxpool)) == NULL)
+			sc->sc_info.rx_zcnobuf++;
+		if (rx->rx_rb != NULL)
+			buf = rx->rx_rb->rb_buf;
+	}
+
+	/* Count first, the callback may run right away */
+	sc->sc_info.rx_posted = atomic_fetchadd_int(&sc->sc_rx_posted, 1) + 1;
+	usbd_setup_xfer(rx->rx_xfer, rx, buf,
 	    sc->sc_rx_bufsz, USBD_SHORT_XFER_OK,
 	    USBD_NO_TIMEOUT, umb_rxeof);
-	usbd_transfer(sc->sc_rx_xfer);
+	err = usbd_transfer(rx->rx_xfer);
+	if (err != USBD_IN_PROGRESS) {
+		DPRINTF("%s: start rx error: %s\n", DEVNAM(sc),
+		    usbd_errstr(err));
+		sc->sc_info.rx_posted =
+		    atomic_fetchadd_int(&sc->sc_rx_posted, -1) - 1;
+	}
 }
 
+/*
+ * The other transfers of the ring stay posted while this NTB is
+ * decapsulated, so the device has somewhere to put the next one. The
+ * number still posted is summed up for the average ring occupancy,
+ * and counted separately if it was none.
+ *
+ * With umb_rx_poll set, completions that leave less than half of the
+ * ring posted hand over to umb_rx_poll_task(): from then on NTBs are
+ * only queued here, and the task decapsulates them in its own thread,
+ * umb_rx_budget datagrams at a time. Once it has caught up, NTBs are
+ * decapsulated right here again. The switch waits until no NTB is
+ * being decapsulated here, so the task never overtakes one. A ring of
+ * a single transfer never has any left posted and is not polled: the
+ * device has to wait for the repost either way.
+ */
 static void
 umb_rxeof(struct usbd_xfer *xfer, void *priv, usbd_status status)
 {
-	struct umb_softc *sc = priv;
+	struct umb_rx *rx = priv;
+	struct umb_softc *sc = rx->rx_sc;
 	struct ifnet *ifp = GET_IFP(sc);
+	u_int	 posted;
+	int	 poll;
 
+	posted = atomic_fetchadd_int(&sc->sc_rx_posted, -1) - 1;
+	sc->sc_info.rx_posted = posted;
 	if (sc->sc_dying || !(ifp->if_flags & IFF_RUNNING))
 		return;
 
@@ -1822,228 +3084,983 @@ umb_rxeof(struct usbd_xfer *xfer, void *priv, usbd_status status)
 		}
 	} else {
 		sc->sc_rx_nerr = 0;
-		umb_decap(sc, xfer);
+		sc->sc_info.rx_ntbs++;
+		sc->sc_info.rx_ringsum += posted;
+		if (posted == 0)
+			sc->sc_info.rx_ringempty++;
+
+		mtx_lock(&sc->sc_rx_mtx);
+		if (!(ifp->if_flags & IFF_RUNNING)) {
+			/* umb_close_bulkpipes() got here first */
+			mtx_unlock(&sc->sc_rx_mtx);
+			return;
+		}
+		if (!sc->sc_rx_polling && umb_rx_poll && sc->sc_rx_cnt > 1 &&
+		    posted < sc->sc_rx_cnt / 2 && sc->sc_rx_inline == 0) {
+			sc->sc_rx_polling = sc->sc_info.rx_polling = 1;
+			sc->sc_info.rx_pollswitches++;
+		}
+		if ((poll = sc->sc_rx_polling))
+			STAILQ_INSERT_TAIL(&sc->sc_rx_pollq, rx, rx_link);
+		else
+			sc->sc_rx_inline++;
+		mtx_unlock(&sc->sc_rx_mtx);
+		if (poll) {
+			taskqueue_enqueue(sc->sc_rx_tq, &sc->sc_rx_task);
+			return;
+		}
+		umb_rx_done(sc, rx);
+		mtx_lock(&sc->sc_rx_mtx);
+		sc->sc_rx_inline--;
+		mtx_unlock(&sc->sc_rx_mtx);
 	}
 
-	umb_rx(sc);
+	umb_rx(sc, rx);
 	return;
 }
 
+/*
+ * Decapsulate the NTB of a completed transfer, which can then be
+ * posted again. Returns the number of datagrams in it.
+ */
+static int
+umb_rx_done(struct umb_softc *sc, struct umb_rx *rx)
+{
+	struct ifnet *ifp = GET_IFP(sc);
+	uint32_t len;
+	int	 n;
+
+	n = umb_decap(sc, rx->rx_xfer, rx->rx_rb);
+
+	/* What umb_rx_connect_ntbsize() goes by */
+	usbd_get_xfer_status(rx->rx_xfer, NULL, NULL, &len, NULL);
+	sc->sc_rx_adapt_ntbs++;
+	sc->sc_rx_adapt_bytes += len;
+	sc->sc_rx_adapt_dgrams += n;
+	if (len + ifp->if_mtu > sc->sc_rx_bufsz)
+		sc->sc_rx_adapt_full++;
+
+	/* Datagrams still use the buffer, post a fresh one */
+	if (rx->rx_rb != NULL && rx->rx_rb->rb_refs > 1) {
+		umb_rxbuf_lend(rx->rx_rb);
+		rx->rx_rb = NULL;
+	}
+	return n;
+}
+
+/*
+ * Work through the queued NTBs, reposting each transfer after its
+ * NTB. Whole NTBs are taken, so a pass may overshoot the budget by
+ * one. If the budget runs out first, the task requeues itself to let
+ * others run; if the queue runs empty, completions decapsulate
+ * inline again.
+ */
+static void
+umb_rx_poll_task(void *arg, int pending)
+{
+	struct umb_softc *sc = arg;
+	struct ifnet *ifp = GET_IFP(sc);
+	struct umb_rx *rx;
+	int	 budget, n = 0;
+
+	budget = MAX(umb_rx_budget, 1);
+	sc->sc_info.rx_pollpasses++;
+	for (;;) {
+		mtx_lock(&sc->sc_rx_mtx);
+		if (sc->sc_dying || !(ifp->if_flags & IFF_RUNNING))
+			STAILQ_INIT(&sc->sc_rx_pollq);
+		if ((rx = STAILQ_FIRST(&sc->sc_rx_pollq)) == NULL) {
+			sc->sc_rx_polling = sc->sc_info.rx_polling = 0;
+			mtx_unlock(&sc->sc_rx_mtx);
+			return;
+		}
+		if (n >= budget) {
+			mtx_unlock(&sc->sc_rx_mtx);
+			sc->sc_info.rx_pollexhausted++;
+			taskqueue_enqueue(sc->sc_rx_tq, &sc->sc_rx_task);
+			return;
+		}
+		STAILQ_REMOVE_HEAD(&sc->sc_rx_pollq, rx_link);
+		mtx_unlock(&sc->sc_rx_mtx);
+
+		n += umb_rx_done(sc, rx);
+		umb_rx(sc, rx);
+	}
+}
+
+/*
+ * Pick the in-NTB size as the bulk pipes open at connect, from what
+ * was received since it was last picked: double it while a good share
+ * of NTBs come in full and often, so there are fewer completions for
+ * the same data, and halve it while NTBs stay mostly empty with hardly
+ * more than one datagram each, so buffers are not wasted. The size of
+ * a running link is left alone; it takes effect from the next connect,
+ * with the transfers allocated anew.
+ */
+static void
+umb_rx_connect_ntbsize(struct umb_softc *sc)
+{
+	uint64_t ntbs = sc->sc_rx_adapt_ntbs;
+	int64_t	 ms = sc->sc_rx_adapt_time / SBT_1MS;
+	int	 cur = sc->sc_rx_bufsz, max, size;
+
+	if (ntbs < UMB_RX_ADAPT_NTBS || ms <= 0)
+		return;
+	max = sc->sc_rx_ntbmax;
+	if (umb_rx_ntbsize > 0)
+		max = MIN(MAX(umb_rx_ntbsize, UMB_NTB_MINSIZE), max);
+
+	size = cur;
+	if (sc->sc_rx_adapt_full * 4 > ntbs &&
+	    ntbs * 1000 / ms >= UMB_RX_ADAPT_RATE)
+		size = MIN(cur * 2, max);
+	else if (sc->sc_rx_adapt_bytes / ntbs < cur / 4 &&
+	    sc->sc_rx_adapt_dgrams < 2 * ntbs)
+		size = MAX(cur / 2, MIN(UMB_RX_ADAPT_MIN, max));
+	else if (cur > max)
+		size = max;
+
+	sc->sc_rx_adapt_ntbs = sc->sc_rx_adapt_full = 0;
+	sc->sc_rx_adapt_bytes = sc->sc_rx_adapt_dgrams = 0;
+	sc->sc_rx_adapt_time = 0;
+	if (size == cur)
+		return;
+
+	umb_free_xfers(sc);
+	sc->sc_rx_bufsz = umb_ncm_insize(sc, size);
+	sc->sc_info.rx_ntbsize = sc->sc_rx_bufsz;
+	sc->sc_info.rx_ntbresized++;
+	DPRINTF("%s: in-NTB size %d -> %d\n", DEVNAM(sc), cur,
+	    sc->sc_rx_bufsz);
+}
+
+static struct umb_rxpool *
+umb_rxpool_create(int bufsz)
+{
+	struct umb_rxpool *rp;
+
+	rp = malloc(sizeof(*rp), M_USB_UMB, M_WAITOK | M_ZERO);
+	mtx_init(&rp->rp_mtx, "umb rxpool", NULL, MTX_DEF);
+	SLIST_INIT(&rp->rp_free);
+	rp->rp_bufsz = bufsz;
+	return rp;
+}
+
+/*
+ * Free the idle buffers. Those still lent out are freed when they
+ * come back, the last one takes the pool with it.
+ */
+static void
+umb_rxpool_destroy(struct umb_rxpool *rp)
+{
+	struct umb_rxbuf *rb;
+	int	 last;
+
+	mtx_lock(&rp->rp_mtx);
+	rp->rp_closed = 1;
+	while ((rb = SLIST_FIRST(&rp->rp_free)) != NULL) {
+		SLIST_REMOVE_HEAD(&rp->rp_free, rb_link);
+		free(rb->rb_buf, M_USB_UMB);
+		free(rb, M_USB_UMB);
+		rp->rp_nbufs--;
+	}
+	last = rp->rp_nbufs == 0;
+	mtx_unlock(&rp->rp_mtx);
+	if (last) {
+		mtx_destroy(&rp->rp_mtx);
+		free(rp, M_USB_UMB);
+	}
+}
+
+/*
+ * Take an idle buffer, or allocate one while below UMB_RX_POOL_MAX.
+ * The caller holds its only reference.
+ */
+static struct umb_rxbuf *
+umb_rxbuf_get(struct umb_rxpool *rp)
+{
+	struct umb_rxbuf *rb;
+
+	mtx_lock(&rp->rp_mtx);
+	if ((rb = SLIST_FIRST(&rp->rp_free)) != NULL)
+		SLIST_REMOVE_HEAD(&rp->rp_free, rb_link);
+	else if (rp->rp_nbufs < UMB_RX_POOL_MAX) {
+		rb = malloc(sizeof(*rb), M_USB_UMB, M_NOWAIT | M_ZERO);
+		if (rb != NULL && (rb->rb_buf = malloc(rp->rp_bufsz,
+		    M_USB_UMB, M_NOWAIT)) == NULL) {
+			free(rb, M_USB_UMB);
+			rb = NULL;
+		}
+		if (rb != NULL) {
+			rb->rb_pool = rp;
+			rp->rp_nbufs++;
+		}
+	}
+	mtx_unlock(&rp->rp_mtx);
+	if (rb != NULL)
+		rb->rb_refs = 1;
+	return rb;
+}
+
+static void
+umb_rxbuf_put(struct umb_rxbuf *rb)
+{
+	struct umb_rxpool *rp = rb->rb_pool;
+	int	 last;
+
+	if (atomic_fetchadd_int(&rb->rb_refs, -1) != 1)
+		return;
+
+	mtx_lock(&rp->rp_mtx);
+	if (rb->rb_lent) {
+		rb->rb_lent = 0;
+		rp->rp_lent--;
+	}
+	if (!rp->rp_closed) {
+		SLIST_INSERT_HEAD(&rp->rp_free, rb, rb_link);
+		mtx_unlock(&rp->rp_mtx);
+		return;
+	}
+	last = --rp->rp_nbufs == 0;
+	mtx_unlock(&rp->rp_mtx);
+	free(rb->rb_buf, M_USB_UMB);
+	free(rb, M_USB_UMB);
+	if (last) {
+		mtx_destroy(&rp->rp_mtx);
+		free(rp, M_USB_UMB);
+	}
+}
+
+/*
+ * Drop the transfer's reference to a buffer its mbufs still use.
+ */
+static void
+umb_rxbuf_lend(struct umb_rxbuf *rb)
+{
+	struct umb_rxpool *rp = rb->rb_pool;
+
+	mtx_lock(&rp->rp_mtx);
+	rb->rb_lent = 1;
+	rp->rp_lent++;
+	mtx_unlock(&rp->rp_mtx);
+	umb_rxbuf_put(rb);
+}
+
+static void
+umb_rxbuf_extfree(struct mbuf *m)
+{
+	umb_rxbuf_put(m->m_ext.ext_arg1);
+}
+
+/*
+ * Wrap a datagram in rb into an mbuf that holds a reference to it.
+ */
+static struct mbuf *
+umb_rxbuf_mbuf(struct umb_rxbuf *rb, struct ifnet *ifp, char *dp, int dlen)
+{
+	struct mbuf *m;
+
+	if ((m = m_gethdr(M_NOWAIT, MT_DATA)) == NULL)
+		return NULL;
+	atomic_add_int(&rb->rb_refs, 1);
+	m_extadd(m, dp, dlen, umb_rxbuf_extfree, rb, NULL, 0, EXT_NET_DRV);
+	m->m_len = m->m_pkthdr.len = dlen;
+	m->m_pkthdr.rcvif = ifp;
+	return m;
+}
+
+/*
+ * Build an NTB from the send queue and submit it. The datagrams are
+ * copied into tx_buf: usbd_setup_xfer() takes one contiguous buffer,
+ * and the NTH and NDP have to precede the payload in it.
+ */
 static int
-umb_encap(struct umb_softc *sc, struct mbuf *m)
+umb_encap(struct umb_softc *sc, struct umb_tx *tx)
 {
-	struct ncm_header16 *hdr;
-	struct ncm_pointer16 *ptr;
+	struct ifnet *ifp = GET_IFP(sc);
+	struct ncm_header16 *hdr16;
+	struct ncm_header32 *hdr32;
+	struct ncm_pointer16 *ptr16;
+	struct ncm_pointer32 *ptr32;
+	struct ncm_pointer16_dgram *dgram16 = NULL;
+	struct ncm_pointer32_dgram *dgram32 = NULL;
+	struct {
+		struct mbuf	*m;
+		int		 seg;	/* TSO segment, -1 if none */
+		int		 len;
+	} dg[UMB_TX_MAXDGRAMS];
+	struct mbuf *m, **mp;
 	usbd_status  err;
-	int len;
-
-	/* All size constraints have been validated by the caller! */
-	hdr = (struct ncm_header16 *)sc->sc_tx_buf;
-	ptr = (struct ncm_pointer16 *)(hdr + 1);
-	USETDW(hdr->dwSignature, NCM_HDR16_SIG);
-	USETW(hdr->wHeaderLength, sizeof(*hdr));
-	USETW(hdr->wSequence, sc->sc_tx_seq);
+	uint16_t flags;
+	int	 ndgram, lane, i;
+	int	 len, dlen, offs, pad, n;
+	int	 hlen, mss, seg, nseg;
+
+	/*
+	 * Drain the send queue until the NTB is full. Every datagram
+	 * may need up to sc_tx_div - 1 bytes of padding in front.
+	 */
+	ndgram = dlen = 0;
+	mp = &tx->tx_m;
+	while (ndgram < sc->sc_tx_maxdgrams) {
+		m = umb_tx_peek(sc, &lane);
+		if (m == NULL)
+			break;
+
+		/*
+		 * A TSO packet becomes one datagram per segment. It may
+		 * span several NTBs, sc_tx_tsoff tells where to go on.
+		 */
+		if (m->m_pkthdr.csum_flags & CSUM_TSO) {
+			hlen = umb_tso_hlen(m);
+			mss = m->m_pkthdr.tso_segsz;
+			nseg = howmany(m->m_pkthdr.len - hlen, mss);
+			seg = (m == sc->sc_tx_tsom) ? sc->sc_tx_tsoff : 0;
+			n = seg;
+			for (; seg < nseg && ndgram < sc->sc_tx_maxdgrams;
+			    seg++) {
+				len = hlen + MIN(mss,
+				    m->m_pkthdr.len - hlen - seg * mss);
+				if (UMB_NTB_HDRLEN(sc, ndgram + 1) + dlen +
+				    len + sc->sc_tx_div - 1 > sc->sc_tx_bufsz)
+					break;
+				dg[ndgram].m = m;
+				dg[ndgram].seg = seg;
+				dg[ndgram].len = len;
+				dlen += len + sc->sc_tx_div - 1;
+				ndgram++;
+			}
+			if (n == 0 && seg > 0) {
+				bpf_mtap(ifp, m, BPF_D_OUT);
+				sc->sc_info.tx_tso++;
+			}
+			sc->sc_info.tx_tsosegs += seg - n;
+			if (seg < nseg && ndgram > 0) {
+				sc->sc_tx_tsom = m;
+				sc->sc_tx_tsoff = seg;
+				break;
+			}
+			sc->sc_tx_tsom = NULL;
+			umb_tx_dequeue(sc, lane, m);
+			if (seg < nseg) {
+				/* Not a single segment fits */
+				DPRINTF("%s: dropping oversized TSO packet "
+				    "(mss %d)\n", DEVNAM(sc), mss);
+				if_inc_counter(ifp, IFCOUNTER_OERRORS, 1);
+				m_freem(m);
+				continue;
+			}
+			*mp = m;
+			mp = &m->m_nextpkt;
+			continue;
+		}
+
+		len = m->m_pkthdr.len + sc->sc_tx_div - 1;
+		if (UMB_NTB_HDRLEN(sc, ndgram + 1) + dlen + len >
+		    sc->sc_tx_bufsz) {
+			if (ndgram > 0)
+				break;
+			/* Can never be sent */
+			umb_tx_dequeue(sc, lane, m);
+			DPRINTF("%s: dropping oversized packet (len %d)\n",
+			    DEVNAM(sc), m->m_pkthdr.len);
+			if_inc_counter(ifp, IFCOUNTER_OERRORS, 1);
+			m_freem(m);
+			continue;
+		}
+		umb_tx_dequeue(sc, lane, m);
+		if (umb_ackf_obsolete(sc, m)) {
+			sc->sc_info.tx_ackdrops++;
+			m_freem(m);
+			continue;
+		}
+		bpf_mtap(ifp, m, BPF_D_OUT);
+		*mp = m;
+		mp = &m->m_nextpkt;
+		dg[ndgram].m = m;
+		dg[ndgram].seg = -1;
+		dg[ndgram].len = m->m_pkthdr.len;
+		dlen += len;
+		ndgram++;
+	}
+	*mp = NULL;
+	if (ndgram == 0)
+		return 0;
+
+	offs = UMB_NTB_HDRLEN(sc, ndgram);
+	memset(tx->tx_buf, 0, sc->sc_tx_ndpoffs);
+	if (sc->sc_flags & UMBFLG_NTB32) {
+		hdr32 = (struct ncm_header32 *)tx->tx_buf;
+		ptr32 = (struct ncm_pointer32 *)(tx->tx_buf + sc->sc_tx_ndpoffs);
+		USETDW(hdr32->dwSignature, NCM_HDR32_SIG);
+		USETW(hdr32->wHeaderLength, sizeof(*hdr32));
+		USETW(hdr32->wSequence, sc->sc_tx_seq);
+		USETDW(hdr32->dwNdpIndex, sc->sc_tx_ndpoffs);
+
+		USETDW(ptr32->dwSignature, MBIM_NCM_NTH32_SIG(umb_session_id));
+		USETW(ptr32->wLength, offs - sc->sc_tx_ndpoffs);
+		USETW(ptr32->wReserved6, 0);
+		USETDW(ptr32->dwNextNdpIndex, 0);
+		USETDW(ptr32->dwReserved12, 0);
+		dgram32 = ptr32->dgram;
+	} else {
+		hdr16 = (struct ncm_header16 *)tx->tx_buf;
+		ptr16 = (struct ncm_pointer16 *)(tx->tx_buf + sc->sc_tx_ndpoffs);
+		USETDW(hdr16->dwSignature, NCM_HDR16_SIG);
+		USETW(hdr16->wHeaderLength, sizeof(*hdr16));
+		USETW(hdr16->wSequence, sc->sc_tx_seq);
+		USETW(hdr16->wNdpIndex, sc->sc_tx_ndpoffs);
+
+		USETDW(ptr16->dwSignature, MBIM_NCM_NTH16_SIG(umb_session_id));
+		USETW(ptr16->wLength, offs - sc->sc_tx_ndpoffs);
+		USETW(ptr16->wNextNdpIndex, 0);
+		dgram16 = ptr16->dgram;
+	}
 	sc->sc_tx_seq++;
 
-	len = m->m_pkthdr.len;
+	pad = 0;
+	for (i = 0; i < ndgram; i++) {
+		m = dg[i].m;
+		len = dg[i].len;
+		n = umb_tx_align(sc, offs) - offs;
+		memset(tx->tx_buf + offs, 0, n);
+		offs += n;
+		pad += n;
+		if (dgram32 != NULL) {
+			USETDW(dgram32->dwDatagramIndex, offs);
+			USETDW(dgram32->dwDatagramLen, len);
+			dgram32++;
+		} else {
+			USETW(dgram16->wDatagramIndex, offs);
+			USETW(dgram16->wDatagramLen, len);
+			dgram16++;
+		}
+		if (dg[i].seg >= 0)
+			umb_tso_copy(m, umb_tso_hlen(m), dg[i].seg, len,
+			    tx->tx_buf + offs);
+		else
+			m_copydata(m, 0, len, tx->tx_buf + offs);
+		offs += len;
+	}
 
-	USETDW(ptr->dwSignature, MBIM_NCM_NTH16_SIG(umb_session_id));
-	USETW(ptr->wLength, sizeof(*ptr));
-	USETW(ptr->wNextNdpIndex, 0);
-	USETW(ptr->dgram[0].wDatagramIndex, MBIM_HDR16_LEN);
-	USETW(ptr->dgram[0].wDatagramLen, len);
-	USETW(ptr->dgram[1].wDatagramIndex, 0);
-	USETW(ptr->dgram[1].wDatagramLen, 0);
-
-	KASSERT(len <= sc->sc_tx_bufsz - sizeof(*hdr) - sizeof(*ptr));
-	m_copydata(m, 0, len, ptr + 1);
-	sc->sc_tx_m = m;
-	len += MBIM_HDR16_LEN;
-	USETW(hdr->wBlockLength, len);
-
-	DPRINTFN(3, "%s: encap %d bytes\n", DEVNAM(sc), len);
-	DDUMPN(5, sc->sc_tx_buf, len);
-	usbd_setup_xfer(sc->sc_tx_xfer, sc, sc->sc_tx_buf, len,
-	    USBD_FORCE_SHORT_XFER, umb_xfer_tout, umb_txeof);
-	err = usbd_transfer(sc->sc_tx_xfer);
+	/*
+	 * An NTB shorter than dwNtbOutMaxSize must end with a short
+	 * packet. Rather than following it with a zero length packet,
+	 * add a pad byte if it happens to be a multiple of the packet
+	 * size. Our buffer may be smaller than what the device takes;
+	 * if it is full, a zero length packet it is.
+	 */
+	flags = USBD_FORCE_SHORT_XFER;
+	if (sc->sc_tx_mps > 0) {
+		flags = 0;
+		if (offs < sc->sc_tx_ntbmax && (offs % sc->sc_tx_mps) == 0) {
+			if (offs < sc->sc_tx_bufsz) {
+				tx->tx_buf[offs++] = 0;
+				pad++;
+			} else
+				flags = USBD_FORCE_SHORT_XFER;
+		}
+	}
+	KASSERT(offs <= sc->sc_tx_bufsz);
+	if (dgram32 != NULL) {
+		USETDW(dgram32->dwDatagramIndex, 0);
+		USETDW(dgram32->dwDatagramLen, 0);
+		USETDW(hdr32->dwBlockLength, offs);
+	} else {
+		USETW(dgram16->wDatagramIndex, 0);
+		USETW(dgram16->wDatagramLen, 0);
+		USETW(hdr16->wBlockLength, offs);
+	}
+
+	DPRINTFN(3, "%s: encap %d datagrams, %d bytes\n", DEVNAM(sc),
+	    ndgram, offs);
+	DDUMPN(5, tx->tx_buf, offs);
+	tx->tx_ndgram = ndgram;
+	tx->tx_len = offs;
+	for (tx->tx_dlen = 0, i = 0; i < ndgram; i++)
+		tx->tx_dlen += dg[i].len;
+	tx->tx_stamp = getsbinuptime();
+	sc->sc_tx_nbytes += offs;
+	if (sc->sc_tx_tbrate > 0)
+		sc->sc_tx_tokens -= offs;
+	sc->sc_info.tx_ntbs++;
+	sc->sc_info.tx_dgrams += ndgram;
+	sc->sc_info.tx_padbytes += pad;
+
+	/* Account before submitting, the callback may run right away */
+	sc->sc_tx_prod = (sc->sc_tx_prod + 1) % sc->sc_tx_cnt;
+	sc->sc_tx_busy++;
+	usbd_setup_xfer(tx->tx_xfer, tx, tx->tx_buf, offs,
+	    flags, umb_xfer_tout, umb_txeof);
+	err = usbd_transfer(tx->tx_xfer);
 	if (err != USBD_IN_PROGRESS) {
 		DPRINTF("%s: start tx error: %s\n", DEVNAM(sc),
 		    usbd_errstr(err));
+		sc->sc_tx_prod = (sc->sc_tx_prod + sc->sc_tx_cnt - 1) %
+		    sc->sc_tx_cnt;
+		sc->sc_tx_busy--;
+		sc->sc_tx_nbytes -= offs;
+		if_inc_counter(ifp, IFCOUNTER_OERRORS, ndgram);
+		umb_tx_freem(tx->tx_m);
+		tx->tx_m = NULL;
 		return 0;
 	}
-	return 1;
+	return ndgram;
+}
+
+/*
+ * Next offset at or after offs where a datagram may start.
+ */
+static int
+umb_tx_align(struct umb_softc *sc, int offs)
+{
+	return offs + (sc->sc_tx_div + sc->sc_tx_rem - offs % sc->sc_tx_div) %
+	    sc->sc_tx_div;
+}
+
+/*
+ * Free a list of packets linked by m_nextpkt.
+ */
+static void
+umb_tx_freem(struct mbuf *m)
+{
+	struct mbuf *n;
+
+	while (m != NULL) {
+		n = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		m_freem(m);
+		m = n;
+	}
+}
+
+/*
+ * Make sure the IP and TCP headers of a TSO packet are contiguous, so
+ * umb_tso_copy() can take them as template for every segment.
+ */
+static struct mbuf *
+umb_tso_prepare(struct mbuf *m)
+{
+	struct ip *ip;
+	struct tcphdr *th;
+	int	 iphlen;
+
+	if (m->m_pkthdr.tso_segsz <= 0 ||
+	    (m = m_pullup(m, sizeof(*ip))) == NULL)
+		goto fail;
+	ip = mtod(m, struct ip *);
+	iphlen = ip->ip_hl << 2;
+	if (ip->ip_v != IPVERSION || ip->ip_p != IPPROTO_TCP ||
+	    iphlen < sizeof(*ip) ||
+	    (m = m_pullup(m, iphlen + sizeof(*th))) == NULL)
+		goto fail;
+	th = (struct tcphdr *)(mtod(m, char *) + iphlen);
+	if ((th->th_off << 2) < sizeof(*th) ||
+	    (m = m_pullup(m, iphlen + (th->th_off << 2))) == NULL)
+		goto fail;
+	if (m->m_pkthdr.len <= umb_tso_hlen(m))
+		goto fail;
+	return m;
+
+fail:
+	m_freem(m);
+	return NULL;
+}
+
+static int
+umb_tso_hlen(struct mbuf *m)
+{
+	struct ip *ip = mtod(m, struct ip *);
+	struct tcphdr *th;
+
+	th = (struct tcphdr *)(mtod(m, char *) + (ip->ip_hl << 2));
+	return (ip->ip_hl << 2) + (th->th_off << 2);
+}
+
+/*
+ * Build TSO segment seg of len bytes at buf: copy the headers and the
+ * payload, then fix up the headers and compute both checksums.
+ */
+static void
+umb_tso_copy(struct mbuf *m, int hlen, int seg, int len, char *buf)
+{
+	struct ip *ip;
+	struct tcphdr *th;
+	uint32_t sum;
+	int	 iphlen, off;
+
+	off = hlen + seg * m->m_pkthdr.tso_segsz;
+	memcpy(buf, mtod(m, char *), hlen);
+	m_copydata(m, off, len - hlen, buf + hlen);
+
+	ip = (struct ip *)buf;
+	iphlen = ip->ip_hl << 2;
+	th = (struct tcphdr *)(buf + iphlen);
+	th->th_seq = htonl(ntohl(th->th_seq) + seg * m->m_pkthdr.tso_segsz);
+	if (seg > 0)
+		th->th_flags &= ~TH_CWR;
+	if (off + len - hlen < m->m_pkthdr.len)
+		th->th_flags &= ~(TH_FIN | TH_PSH);
+
+	ip->ip_len = htons(len);
+	ip->ip_id = htons(ntohs(ip->ip_id) + seg);
+	ip->ip_sum = 0;
+	ip->ip_sum = ~umb_cksum(ip, iphlen, 0);
+
+	/* pseudo header */
+	sum = umb_cksum(&ip->ip_src, 2 * sizeof(struct in_addr),
+	    htons(IPPROTO_TCP) + htons(len - iphlen));
+	th->th_sum = 0;
+	th->th_sum = ~umb_cksum(th, len - iphlen, sum);
+}
+
+/*
+ * Internet checksum over len bytes, starting with sum. Returns the
+ * folded, not yet complemented, sum.
+ */
+static uint32_t
+umb_cksum(const void *buf, int len, uint32_t sum)
+{
+	const uint8_t *p = buf;
+	uint16_t w;
+
+	for (; len > 1; len -= 2, p += 2) {
+		memcpy(&w, p, sizeof(w));
+		sum += w;
+	}
+	if (len > 0) {
+		w = 0;
+		*(uint8_t *)&w = *p;
+		sum += w;
+	}
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
 }
 
 static void
 umb_txeof(struct usbd_xfer *xfer, void *priv, usbd_status status)
 {
-	struct umb_softc *sc = priv;
+	struct umb_tx *tx = priv;
+	struct umb_softc *sc = tx->tx_sc;
 	struct ifnet *ifp = GET_IFP(sc);
-	int	 s;
+	struct mbuf *m;
 
-	s = splnet();
+	/*
+	 * Everything is done once per NTB: the datagrams are unlinked as
+	 * one list and freed after the lock is dropped, the counters are
+	 * bumped by the NTB totals and the ring is refilled in one go.
+	 */
+	mtx_lock(&sc->sc_tx_mtx);
+	m = tx->tx_m;
+	tx->tx_m = NULL;
+
+	/* Bulk transfers on one pipe complete in submission order */
+	KASSERT(tx == &sc->sc_tx_list[sc->sc_tx_cons]);
+	sc->sc_tx_cons = (sc->sc_tx_cons + 1) % sc->sc_tx_cnt;
+	sc->sc_tx_busy--;
+	sc->sc_tx_nbytes -= tx->tx_len;
 	ifp->if_flags &= ~IFF_OACTIVE;
-	ifp->if_timer = 0;
-
-	m_freem(sc->sc_tx_m);
-	sc->sc_tx_m = NULL;
-
-	if (status != USBD_NORMAL_COMPLETION) {
+	if (sc->sc_tx_busy == 0)
+		ifp->if_timer = 0;
+
+	if (status == USBD_NORMAL_COMPLETION) {
+		if_inc_counter(ifp, IFCOUNTER_OPACKETS, tx->tx_ndgram);
+		if_inc_counter(ifp, IFCOUNTER_OBYTES, tx->tx_dlen);
+		umb_tx_bql(sc, tx);
+		umb_tx_autorate(sc, tx);
+	} else {
 		if (status != USBD_NOT_STARTED && status != USBD_CANCELLED) {
-			ifp->if_oerrors++;
+			if_inc_counter(ifp, IFCOUNTER_OERRORS, tx->tx_ndgram);
 			DPRINTF("%s: tx error: %s\n", DEVNAM(sc),
 			    usbd_errstr(status));
 			if (status == USBD_STALLED)
 				usbd_clear_endpoint_stall_async(sc->sc_tx_pipe);
 		}
 	}
-	if (IFQ_IS_EMPTY(&ifp->if_snd) == 0)
-		umb_start(ifp);
-
-	splx(s);
+	umb_tx_unlock(sc, umb_start_locked(sc));
+	umb_tx_freem(m);
 }
 
+/*
+ * Learn the byte queue limit from completion timing. While the ring
+ * stays busy, an NTB was on the wire from the previous completion
+ * until its own, otherwise from its submission. The limit is the
+ * averaged drain rate times the target time.
+ */
 static void
-umb_decap(struct umb_softc *sc, struct usbd_xfer *xfer)
+umb_tx_bql(struct umb_softc *sc, struct umb_tx *tx)
+{
+	struct ifnet *ifp = GET_IFP(sc);
+	sbintime_t now, dt;
+	uint64_t rate, limit;
+
+	now = getsbinuptime();
+	dt = now - MAX(tx->tx_stamp, sc->sc_tx_lastdone);
+	sc->sc_tx_lastdone = now;
+	if (dt <= 0)
+		return;
+	rate = (uint64_t)tx->tx_len * SBT_1S / dt;
+	if (sc->sc_tx_rate == 0)
+		sc->sc_tx_rate = rate;
+	else
+		sc->sc_tx_rate = (7 * sc->sc_tx_rate + rate) / 8;
+
+	if (umb_tx_bql_target <= 0) {
+		sc->sc_info.tx_bql_limit = 0;
+		return;
+	}
+	limit = sc->sc_tx_rate * umb_tx_bql_target / 1000000;
+	limit = MAX(limit, 2 * ifp->if_mtu);
+	limit = MIN(limit, UMB_TX_BQL_MAX);
+	sc->sc_info.tx_bql_limit = limit;
+}
+
+static int
+umb_decap(struct umb_softc *sc, struct usbd_xfer *xfer, struct umb_rxbuf *rb)
 {
 	struct ifnet *ifp = GET_IFP(sc);
 	int	 s;
 	char	*buf;
 	uint32_t len;
 	char	*dp;
-	struct ncm_header16 *hdr16;
-	struct ncm_header32 *hdr32;
-	struct ncm_pointer16 *ptr16;
-	struct ncm_pointer16_dgram *dgram16;
-	struct ncm_pointer32_dgram *dgram32;
-	uint32_t hsig, psig;
-	int	 hlen, blen;
-	int	 ptrlen, ptroff, dgentryoff;
+	struct umb_ntb nt;
+	int	 ndgram = 0, i;
 	uint32_t doff, dlen;
-	struct mbuf *m;
+	struct mbuf *m, *mhead = NULL, **mtail = &mhead;
+	struct umb_gro gro[UMB_GRO_FLOWS];
 
 	usbd_get_xfer_status(xfer, NULL, (void **)&buf, &len, NULL);
 	DPRINTFN(4, "%s: recv %d bytes\n", DEVNAM(sc), len);
 	DDUMPN(5, buf, len);
-	s = splnet();
-	if (len < sizeof(*hdr16))
-		goto toosmall;
-
-	hdr16 = (struct ncm_header16 *)buf;
-	hsig = UGETDW(hdr16->dwSignature);
-	hlen = UGETW(hdr16->wHeaderLength);
-	if (len < hlen)
-		goto toosmall;
+	if (rb != NULL && rb->rb_pool->rp_lent >= UMB_RX_POOL_LEND) {
+		sc->sc_info.rx_zclent++;
+		rb = NULL;
+	}
 	if (len > sc->sc_rx_bufsz) {
 		DPRINTF("%s: packet too large (%d)\n", DEVNAM(sc), len);
 		goto fail;
 	}
-	switch (hsig) {
-	case NCM_HDR16_SIG:
-		blen = UGETW(hdr16->wBlockLength);
-		ptroff = UGETW(hdr16->wNdpIndex);
-		if (hlen != sizeof(*hdr16)) {
-			DPRINTF("%s: bad header len %d for NTH16 (exp %zu)\n",
-			    DEVNAM(sc), hlen, sizeof(*hdr16));
-			goto fail;
-		}
-		break;
-	case NCM_HDR32_SIG:
-		hdr32 = (struct ncm_header32 *)hdr16;
-		blen = UGETDW(hdr32->dwBlockLength);
-		ptroff = UGETDW(hdr32->dwNdpIndex);
-		if (hlen != sizeof(*hdr32)) {
-			DPRINTF("%s: bad header len %d for NTH32 (exp %zu)\n",
-			    DEVNAM(sc), hlen, sizeof(*hdr32));
-			goto fail;
-		}
-		break;
-	default:
-		DPRINTF("%s: unsupported NCM header signature (0x%08x)\n",
-		    DEVNAM(sc), hsig);
-		goto fail;
-	}
-	if (len < blen) {
-		DPRINTF("%s: bad NTB len (%d) for %d bytes of data\n",
-		    DEVNAM(sc), blen, len);
+	if (umb_ntb_init(&nt, buf, len) != 0) {
+		DPRINTF("%s: %s (%d bytes)\n", DEVNAM(sc), nt.nt_err, len);
 		goto fail;
 	}
 
-	ptr16 = (struct ncm_pointer16 *)(buf + ptroff);
-	psig = UGETDW(ptr16->dwSignature);
-	ptrlen = UGETW(ptr16->wLength);
-	if (len < ptrlen + ptroff)
-		goto toosmall;
-	if (!MBIM_NCM_NTH16_ISISG(psig) && !MBIM_NCM_NTH32_ISISG(psig)) {
-		DPRINTF("%s: unsupported NCM pointer signature (0x%08x)\n",
-		    DEVNAM(sc), psig);
-		goto fail;
-	}
+	memset(gro, 0, sizeof(gro));
+	s = splnet();
+	while (umb_ntb_next(&nt, &doff, &dlen)) {
+		dp = buf + doff;
+		DPRINTFN(3, "%s: decap %d bytes\n", DEVNAM(sc), dlen);
+		/*
+		 * Small datagrams are copied, so they do not keep a whole
+		 * NTB buffer from being reused.
+		 */
+		if (rb != NULL && dlen > MHLEN) {
+			m = umb_rxbuf_mbuf(rb, ifp, dp, dlen);
+			if (m != NULL)
+				sc->sc_info.rx_zcdgrams++;
+		} else
+			m = m_devget(dp, dlen, 0, ifp, NULL);
+		if (m == NULL) {
+			if_inc_counter(ifp, IFCOUNTER_IQDROPS, 1);
+			continue;
+		}
+		ndgram++;
 
-	switch (hsig) {
-	case NCM_HDR16_SIG:
-		dgentryoff = offsetof(struct ncm_pointer16, dgram);
-		break;
-	case NCM_HDR32_SIG:
-		dgentryoff = offsetof(struct ncm_pointer32, dgram);
-		break;
-	default:
-		goto fail;
+		/* Let the stack spread flows over CPUs */
+		if (umb_rx_flowid != UMB_FLOWID_OFF) {
+			m->m_pkthdr.flowid = umb_flow_hash(m, sc->sc_fq_seed,
+			    umb_rx_flowid == UMB_FLOWID_CRC32C);
+			M_HASHTYPE_SET(m, M_HASHTYPE_OPAQUE_HASH);
+		}
+#ifdef INET
+		if ((ifp->if_capenable & IFCAP_LRO) &&
+		    umb_gro_input(sc, gro, m))
+			continue;
+#endif
+
+		*mtail = m;
+		mtail = &m->m_nextpkt;
 	}
+	sc->sc_info.rx_ndps += nt.nt_ndps;
+	sc->sc_info.rx_ndperrs += nt.nt_ndperrs;
+	if (nt.nt_baddgrams)
+		DPRINTF("%s: skipped %u datagrams out of bounds\n",
+		    DEVNAM(sc), nt.nt_baddgrams);
+	if (nt.nt_err != NULL)
+		DPRINTF("%s: %s\n", DEVNAM(sc), nt.nt_err);
+
+	/* LRO does not merge across NTBs */
+	for (i = 0; i < UMB_GRO_FLOWS; i++)
+		if (gro[i].gr_m != NULL)
+			umb_gro_close(sc, &gro[i]);
+
+	/* The whole NTB goes up in one batch */
+	if (mhead != NULL)
+		ifp->_if_input(ifp, mhead);
+	splx(s);
+	return ndgram;
+fail:
+	if_inc_counter(ifp, IFCOUNTER_IERRORS, 1);
+	return 0;
+}
 
-	while (dgentryoff < ptrlen) {
-		switch (hsig) {
-		case NCM_HDR16_SIG:
-			if (ptroff + dgentryoff < sizeof(*dgram16))
-				goto done;
-			dgram16 = (struct ncm_pointer16_dgram *)
-			    (buf + ptroff + dgentryoff);
-			dgentryoff += sizeof(*dgram16);
-			dlen = UGETW(dgram16->wDatagramLen);
-			doff = UGETW(dgram16->wDatagramIndex);
-			break;
-		case NCM_HDR32_SIG:
-			if (ptroff + dgentryoff < sizeof(*dgram32))
-				goto done;
-			dgram32 = (struct ncm_pointer32_dgram *)
-			    (buf + ptroff + dgentryoff);
-			dgentryoff += sizeof(*dgram32);
-			dlen = UGETDW(dgram32->dwDatagramLen);
-			doff = UGETDW(dgram32->dwDatagramIndex);
-			break;
-		default:
-			ifp->if_ierrors++;
-			goto done;
-		}
+/*
+ * LRO: merge back-to-back, in-order TCP segments of a flow within one
+ * NTB into a single packet, so TCP input runs once for all of them.
+ * Any other segment of a flow ends what was merged for it so far, so
+ * nothing gets reordered. m stays first in the flow if it may have
+ * further segments appended. Returns 1 if m was appended to an
+ * earlier one.
+ */
+static int
+umb_gro_input(struct umb_softc *sc, struct umb_gro *gro, struct mbuf *m)
+{
+	struct umb_gro *gr, *slot = NULL;
+	struct ip *ip;
+	struct tcphdr *th;
+	int	 ok, hlen, plen, i;
 
-		/* Terminating zero entry */
-		if (dlen == 0 || doff == 0)
-			break;
-		if (len < dlen + doff) {
-			/* Skip giant datagram but continue processing */
-			DPRINTF("%s: datagram too large (%d @ off %d)\n",
-			    DEVNAM(sc), dlen, doff);
+	if ((ok = umb_gro_check(m, &hlen)) < 0)
+		return 0;
+	ip = mtod(m, struct ip *);
+	th = (struct tcphdr *)(ip + 1);
+	plen = m->m_pkthdr.len - hlen;
+
+	for (i = 0; i < UMB_GRO_FLOWS; i++) {
+		gr = &gro[i];
+		if (gr->gr_m == NULL) {
+			if (slot == NULL)
+				slot = gr;
 			continue;
 		}
-
-		dp = buf + doff;
-		DPRINTFN(3, "%s: decap %d bytes\n", DEVNAM(sc), dlen);
-		m = m_devget(dp, dlen, 0, ifp, NULL);
-		if (m == NULL) {
-			ifp->if_iqdrops++;
+		if (gr->gr_ip->ip_src.s_addr != ip->ip_src.s_addr ||
+		    gr->gr_ip->ip_dst.s_addr != ip->ip_dst.s_addr ||
+		    gr->gr_th->th_sport != th->th_sport ||
+		    gr->gr_th->th_dport != th->th_dport)
 			continue;
+		if (ok && ntohl(th->th_seq) == gr->gr_seq &&
+		    gr->gr_ip->ip_tos == ip->ip_tos &&
+		    gr->gr_th->th_off == th->th_off &&
+		    gr->gr_m->m_pkthdr.len + plen <= IP_MAXPACKET) {
+			umb_gro_append(gr, m, hlen, plen);
+			if (gr->gr_th->th_flags & TH_PUSH)
+				umb_gro_close(sc, gr);
+			return 1;
 		}
+		umb_gro_close(sc, gr);
+		slot = gr;
+		break;
+	}
 
-		if_percpuq_enqueue((ifp)->if_percpuq, (m));
+	/* A pushed segment ends the burst */
+	if (!ok || (th->th_flags & TH_PUSH))
+		return 0;
+	if (slot == NULL) {
+		slot = &gro[0];
+		umb_gro_close(sc, slot);
 	}
-done:
-	splx(s);
-	return;
-toosmall:
-	DPRINTF("%s: packet too small (%d)\n", DEVNAM(sc), len);
-fail:
-	ifp->if_ierrors++;
-	splx(s);
+	slot->gr_m = slot->gr_tail = m;
+	slot->gr_ip = ip;
+	slot->gr_th = th;
+	slot->gr_seq = ntohl(th->th_seq) + plen;
+	slot->gr_nsegs = 1;
+	return 0;
+}
+
+/*
+ * Returns -1 if m is no IPv4 TCP segment in a single mbuf, 0 if it is
+ * one that cannot be merged, and 1 if it can. These carry data, no IP
+ * options, no TCP options but timestamps and no flags but ACK and
+ * PSH. Their checksums are verified here and marked as such, since
+ * the one of a merged packet is not filled in.
+ */
+static int
+umb_gro_check(struct mbuf *m, int *hlen)
+{
+	struct ip *ip;
+	struct tcphdr *th;
+	uint8_t	*opt;
+	uint32_t sum;
+	int	 len;
+
+	len = m->m_pkthdr.len;
+	if (m->m_len != len || len < sizeof(*ip) + sizeof(*th))
+		return -1;
+	ip = mtod(m, struct ip *);
+	if (ip->ip_v != IPVERSION || ip->ip_hl != sizeof(*ip) >> 2 ||
+	    ip->ip_p != IPPROTO_TCP)
+		return -1;
+
+	th = (struct tcphdr *)(ip + 1);
+	opt = (uint8_t *)(th + 1);
+	if (th->th_off == (sizeof(*th) + TCPOLEN_TSTAMP_APPA) >> 2) {
+		if (opt[0] != TCPOPT_NOP || opt[1] != TCPOPT_NOP ||
+		    opt[2] != TCPOPT_TIMESTAMP ||
+		    opt[3] != TCPOLEN_TIMESTAMP)
+			return 0;
+	} else if (th->th_off != sizeof(*th) >> 2)
+		return 0;
+	*hlen = sizeof(*ip) + (th->th_off << 2);
+	if (ntohs(ip->ip_len) != len || *hlen >= len ||
+	    (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) ||
+	    (th->th_flags & ~TH_PUSH) != TH_ACK)
+		return 0;
+
+	if (umb_cksum(ip, sizeof(*ip), 0) != 0xffff)
+		return 0;
+	sum = umb_cksum(&ip->ip_src, 2 * sizeof(struct in_addr),
+	    htons(IPPROTO_TCP) + htons(len - sizeof(*ip)));
+	if (umb_cksum(th, len - sizeof(*ip), sum) != 0xffff)
+		return 0;
+	m->m_pkthdr.csum_flags |= CSUM_IP_CHECKED | CSUM_IP_VALID |
+	    CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+	m->m_pkthdr.csum_data = 0xffff;
+	return 1;
+}
+
+/*
+ * Append the payload of m to the flow and take over its ACK, window,
+ * timestamps and PSH flag.
+ */
+static void
+umb_gro_append(struct umb_gro *gr, struct mbuf *m, int hlen, int plen)
+{
+	struct tcphdr *th = (struct tcphdr *)(mtod(m, struct ip *) + 1);
+
+	gr->gr_th->th_ack = th->th_ack;
+	gr->gr_th->th_win = th->th_win;
+	gr->gr_th->th_flags |= th->th_flags & TH_PUSH;
+	if (th->th_off > sizeof(*th) >> 2)
+		memcpy((uint8_t *)(gr->gr_th + 1) + 4,
+		    (uint8_t *)(th + 1) + 4, TCPOLEN_TIMESTAMP - 2);
+
+	m_adj(m, hlen);
+	m_demote_pkthdr(m);
+	gr->gr_tail->m_next = m;
+	gr->gr_tail = m;
+	gr->gr_m->m_pkthdr.len += plen;
+	gr->gr_seq += plen;
+	gr->gr_nsegs++;
+}
+
+/*
+ * Fix up the IP header of a merged packet. It stays where its first
+ * segment is in the chain for the stack.
+ */
+static void
+umb_gro_close(struct umb_softc *sc, struct umb_gro *gr)
+{
+	struct ip *ip = gr->gr_ip;
+
+	if (gr->gr_nsegs > 1) {
+		ip->ip_len = htons(gr->gr_m->m_pkthdr.len);
+		ip->ip_sum = 0;
+		ip->ip_sum = ~umb_cksum(ip, sizeof(*ip), 0);
+		sc->sc_info.rx_gropkts++;
+		sc->sc_info.rx_grosegs += gr->gr_nsegs;
+	}
+	gr->gr_m = NULL;
 }
 
 static usbd_status
@@ -2318,7 +4335,14 @@ umb_send_connect(struct umb_softc *sc, int command)
 	    sc->sc_info.passwordlen, &c->passwd_offs, &c->passwd_size))
 		goto done;
 	c->authprot = htole32(MBIM_AUTHPROT_NONE);
-	c->compression = htole32(MBIM_COMPRESSION_NONE);
+	if (command == MBIM_CONNECT_ACTIVATE && sc->sc_info.compress &&
+	    sc->sc_info.compression != UMB_COMPRESSION_REJECTED) {
+		c->compression = htole32(MBIM_COMPRESSION_ENABLE);
+		sc->sc_compr_sent = 1;
+	} else {
+		c->compression = htole32(MBIM_COMPRESSION_NONE);
+		sc->sc_compr_sent = 0;
+	}
 	c->iptype = htole32(MBIM_CONTEXT_IPTYPE_IPV4);
 	memcpy(c->context, umb_uuid_context_internet, sizeof(c->context));
 	umb_cmd(sc, MBIM_CID_CONNECT, MBIM_CMDOP_SET, c, off);
@@ -2400,6 +4424,20 @@ umb_command_done(struct umb_softc *sc, void *data, int len)
 	}
 
 	status = le32toh(cmd->status);
+	if (cid == MBIM_CID_CONNECT && !qmimsg && sc->sc_compr_sent) {
+		sc->sc_compr_sent = 0;
+		if (status == MBIM_STATUS_SUCCESS)
+			sc->sc_info.compression = UMB_COMPRESSION_ON;
+		else if (status == MBIM_STATUS_NO_DEVICE_SUPPORT ||
+		    status == MBIM_STATUS_INVALID_PARAMETERS) {
+			if (ifp->if_flags & IFF_DEBUG)
+				log(LOG_INFO, "%s: compression rejected, "
+				    "connecting without\n", DEVNAM(sc));
+			sc->sc_info.compression = UMB_COMPRESSION_REJECTED;
+			usb_add_task(sc->sc_udev, &sc->sc_umb_task,
+			    USB_TASKQ_DRIVER);
+		}
+	}
 	switch (status) {
 	case MBIM_STATUS_SUCCESS:
 		break;
@@ -2468,6 +4506,9 @@ umb_decode_cid(struct umb_softc *sc, uint32_t cid, void *data, int len)
 	case MBIM_CID_IP_CONFIGURATION:
 		ok = umb_decode_ip_configuration(sc, data, len);
 		break;
+	case MBIM_CID_PACKET_STATISTICS:
+		ok = umb_decode_packet_statistics(sc, data, len);
+		break;
 	default:
 		/*
 		 * Note: the above list is incomplete and only contains
@@ -2639,6 +4680,14 @@ umb_intr(struct usbd_xfer *xfer, void *priv, usbd_status status)
 	case UCDC_N_CONNECTION_SPEED_CHANGE:
 		DPRINTFN(2, "%s: umb_intr: connection speed changed\n",
 		    DEVNAM(sc));
+		/* Data is the IN (downlink) and OUT (uplink) bit rate */
+		if (total_len < UCDC_NOTIFICATION_LENGTH + 8)
+			break;
+		sc->sc_info.downlink_speed =
+		    UGETDW(&sc->sc_intr_msg.data[0]);
+		sc->sc_info.uplink_speed =
+		    UGETDW(&sc->sc_intr_msg.data[4]);
+		umb_tx_shape_update(sc);
 		break;
 	default:
 		DPRINTF("%s: unexpected notifiation (0x%02x)\n",
@@ -265,11 +265,36 @@ struct umb_parameter {
 
 	int			roaming;
 	uint32_t		preferredclasses;
+
+#define UMB_TX_MAXHOLD		10000	/* usec */
+	int			txholdtime;
+	int			ackfilter;	/* thin out queued TCP ACKs */
+	int			fqcodel;	/* FQ-CoDel on the bulk lane */
+#define UMB_TX_MAXSHAPE		100	/* percent */
+	int			txshape;	/* % of uplink speed, 0 = off */
+	int			autorate;	/* adapt shaper to TX delay */
+	int			compression;	/* ask for it on connect */
 };
 
 /*
  * UMB device status info (SIOCGUMBINFO ioctl)
  */
+/* Send lanes, drained in this order */
+#define UMB_TX_LANE_PRIO	0	/* small and high DSCP packets */
+#define UMB_TX_LANE_BULK	1
+#define UMB_TX_NLANES		2
+
+/* FQ-CoDel flow queue statistics */
+#define UMB_FQ_FLOWS		64	/* the same in umb_fq.h */
+struct umb_fq_stats {
+	uint64_t		pkts;
+	uint64_t		bytes;
+	uint64_t		drops;
+	uint64_t		marks;		/* ECN CE instead of a drop */
+	uint32_t		qlen;		/* packets queued */
+	uint32_t		backlog;	/* bytes queued */
+};
+
 struct umb_info {
 	enum umb_state		state;
 	int			enable_roaming;
@@ -335,6 +360,78 @@ struct umb_info {
 
 #define UMB_MAX_DNSSRV			2
 	u_int32_t		ipv4dns[UMB_MAX_DNSSRV];
+
+	int			tx_holdtime;	/* usec to coalesce, 0 = off */
+
+	/* transmit statistics */
+	uint64_t		tx_ntbs;
+	uint64_t		tx_dgrams;
+	uint64_t		tx_padbytes;	/* alignment and ZLP padding */
+	uint64_t		tx_holdflush;	/* NTBs flushed by hold timer */
+	uint64_t		tx_bql_limit;	/* byte queue limit, 0 = off */
+	uint64_t		tx_bql_hits;	/* packets dropped at the limit */
+
+	/* per send lane, see UMB_TX_LANE_* */
+	uint64_t		tx_lane_pkts[UMB_TX_NLANES];
+	uint64_t		tx_lane_drops[UMB_TX_NLANES];
+	uint64_t		tx_lane_delay[UMB_TX_NLANES];	/* usec */
+	uint64_t		tx_lane_maxdelay[UMB_TX_NLANES]; /* usec */
+
+	int			tx_ackfilter;
+	uint64_t		tx_ackdrops;	/* ACKs made obsolete */
+
+	uint64_t		tx_tso;		/* TSO packets */
+	uint64_t		tx_tsosegs;	/* segments made from them */
+
+	int			tx_fqcodel;
+	struct umb_fq_stats	tx_fq[UMB_FQ_FLOWS];
+
+	int			tx_shape;	/* % of uplink_speed, 0 = off */
+	uint64_t		tx_shaperate;	/* bit/s */
+	uint64_t		tx_shapedelays;	/* times the shaper waited */
+
+	int			tx_autorate;
+	int64_t			tx_delay;	/* NTB completion delay, usec */
+	int64_t			tx_basedelay;	/* its baseline, usec */
+
+	int			compress;	/* asked for on connect */
+#define UMB_COMPRESSION_OFF	0
+#define UMB_COMPRESSION_ON	1
+#define UMB_COMPRESSION_REJECTED 2
+	int			compression;	/* what the modem agreed to */
+
+	/* bytes since the link came up, see MBIM_CID_PACKET_STATISTICS */
+	uint64_t		link_rxbytes;	/* as counted by the modem */
+	uint64_t		link_txbytes;
+	uint64_t		host_rxbytes;	/* by the interface meanwhile */
+	uint64_t		host_txbytes;
+
+	/* bulk-IN transfer ring */
+	int			rx_ring;	/* transfers in the ring */
+	uint32_t		rx_posted;	/* waiting for data now */
+	uint64_t		rx_ntbs;	/* NTBs received */
+	uint64_t		rx_ringsum;	/* sum of rx_posted at each */
+	uint64_t		rx_ringempty;	/* none left posted */
+
+	int			rx_zerocopy;
+	uint64_t		rx_zcdgrams;	/* passed up without a copy */
+	uint64_t		rx_zcnobuf;	/* no pool buffer to post */
+	uint64_t		rx_zclent;	/* NTBs copied, pool lent out */
+
+	uint64_t		rx_ndps;	/* NDPs parsed */
+	uint64_t		rx_ndperrs;	/* bad NDPs or NDP chains */
+
+	uint64_t		rx_gropkts;	/* TCP packets merged by LRO */
+	uint64_t		rx_grosegs;	/* segments they were made of */
+
+	int			rx_polling;	/* NTBs left to the poll task */
+	uint64_t		rx_pollswitches; /* times it took over */
+	uint64_t		rx_pollpasses;
+	uint64_t		rx_pollexhausted; /* passes out of budget */
+
+	int			rx_ntbsize;	/* in-NTB size negotiated */
+	int			rx_ntbmax;	/* largest the device takes */
+	uint64_t		rx_ntbresized;	/* times changed at connect */
 };
 
 #if !defined(ifr_mtu)
@@ -342,6 +439,79 @@ struct umb_info {
 #endif
 
 #ifdef _KERNEL
+/*
+ * Bulk-IN transfer, one NTB each
+ */
+#define UMB_RX_LIST_CNT		4	/* default ring size */
+#define UMB_RX_LIST_MAX		8
+struct umb_rx {
+	struct umb_softc	*rx_sc;
+	struct usbd_xfer	*rx_xfer;
+	char			*rx_buf;
+	struct umb_rxbuf	*rx_rb;		/* zero-copy buffer posted */
+	STAILQ_ENTRY(umb_rx)	 rx_link;	/* on sc_rx_pollq */
+};
+
+/*
+ * Zero-copy receive: NTBs go into pool buffers, datagram mbufs point
+ * into them. A buffer returns to the pool when the transfer and the
+ * last of its mbufs are done with it. Once the pool is closed,
+ * returned buffers are freed and the last one frees the pool.
+ *
+ * An mbuf only accounts for its datagram, not for the whole buffer it
+ * pins, so a slow reader can hold on to far more memory than its
+ * socket buffer shows. Once UMB_RX_POOL_LEND buffers are lent out
+ * that way, datagrams are copied again.
+ */
+#define UMB_RX_POOL_MAX		32	/* buffers */
+#define UMB_RX_POOL_LEND	(UMB_RX_POOL_MAX / 4)
+struct umb_rxpool;
+struct umb_rxbuf {
+	struct umb_rxpool	*rb_pool;
+	char			*rb_buf;
+	u_int			 rb_refs;
+	int			 rb_lent;	/* only held by mbufs */
+	SLIST_ENTRY(umb_rxbuf)	 rb_link;
+};
+struct umb_rxpool {
+	struct mtx		 rp_mtx;
+	SLIST_HEAD(, umb_rxbuf)	 rp_free;
+	int			 rp_bufsz;
+	int			 rp_nbufs;	/* allocated */
+	int			 rp_lent;	/* only held by mbufs */
+	int			 rp_closed;
+};
+
+/*
+ * LRO flow, the segments merged so far. Only lives while one NTB is
+ * decapsulated.
+ */
+#define UMB_GRO_FLOWS		8
+struct umb_gro {
+	struct mbuf		*gr_m;		/* first segment, with headers */
+	struct mbuf		*gr_tail;	/* last mbuf of its chain */
+	struct ip		*gr_ip;
+	struct tcphdr		*gr_th;
+	uint32_t		 gr_seq;	/* next expected sequence no. */
+	int			 gr_nsegs;
+};
+
+/*
+ * Bulk-OUT transfer, one NTB each
+ */
+#define UMB_TX_LIST_CNT		4	/* default ring size */
+#define UMB_TX_LIST_MAX		8
+struct umb_tx {
+	struct umb_softc	*tx_sc;
+	struct usbd_xfer	*tx_xfer;
+	char			*tx_buf;
+	struct mbuf		*tx_m;		/* datagrams linked by m_nextpkt */
+	int			 tx_ndgram;
+	int			 tx_len;	/* NTB length */
+	int			 tx_dlen;	/* datagram bytes */
+	sbintime_t		 tx_stamp;	/* submission time */
+};
+
 /*
  * UMB device
  */
@@ -359,6 +529,8 @@ struct umb_softc {
 	int			 sc_maxsessions;
 
 #define UMBFLG_FCC_AUTH_REQUIRED	0x0001
+#define UMBFLG_NTB32			0x0004	/* NTB32 format selected */
+#define UMBFLG_NTBINPUTSIZE8		0x0008	/* 8 byte SetNtbInputSize */
 	uint32_t		 sc_flags;
 	int			 sc_cid;
 
@@ -378,19 +550,77 @@ struct umb_softc {
 	void			*sc_ctrl_msg;
 
 	int			 sc_rx_ep;
-	struct usbd_xfer	*sc_rx_xfer;
-	char			*sc_rx_buf;
-	int			 sc_rx_bufsz;
+	struct umb_rx		 sc_rx_list[UMB_RX_LIST_MAX];
+	int			 sc_rx_cnt;	/* transfers in the ring */
+	u_int			 sc_rx_posted;	/* transfers submitted */
+	struct umb_rxpool	*sc_rxpool;	/* zero-copy buffers */
+	int			 sc_rx_bufsz;	/* in-NTB size negotiated */
+	int			 sc_rx_devmax;	/* dwNtbInMaxSize */
+	int			 sc_rx_ntbmax;	/* largest we ask for */
+	sbintime_t		 sc_rx_adapt_up; /* bulk pipes opened */
+	sbintime_t		 sc_rx_adapt_time; /* time up since last adapted */
+	uint64_t		 sc_rx_adapt_ntbs; /* NTBs meanwhile */
+	uint64_t		 sc_rx_adapt_full; /* no room for another */
+	uint64_t		 sc_rx_adapt_bytes;
+	uint64_t		 sc_rx_adapt_dgrams;
 	struct usbd_pipe	*sc_rx_pipe;
 	unsigned		 sc_rx_nerr;
+	struct mtx		 sc_rx_mtx;	/* poll queue */
+	STAILQ_HEAD(, umb_rx)	 sc_rx_pollq;	/* completed, not decapsulated */
+	int			 sc_rx_polling;
+	int			 sc_rx_inline;	/* NTBs decapsulated in umb_rxeof() */
+	struct taskqueue	*sc_rx_tq;
+	struct task		 sc_rx_task;
 
 	int			 sc_tx_ep;
-	struct usbd_xfer	*sc_tx_xfer;
-	char			*sc_tx_buf;
+	struct mtx		 sc_tx_mtx;	/* TX ring and NTB assembly */
+	struct buf_ring		*sc_tx_br[UMB_TX_NLANES]; /* send queues */
+	struct umb_tx		 sc_tx_list[UMB_TX_LIST_MAX];
+	int			 sc_tx_cnt;	/* transfers in the ring */
+	int			 sc_tx_prod;
+	int			 sc_tx_cons;
+	int			 sc_tx_busy;	/* transfers in flight */
 	int			 sc_tx_bufsz;
+	uint32_t		 sc_tx_ntbmax;	/* dwNtbOutMaxSize */
 	struct usbd_pipe	*sc_tx_pipe;
-	struct mbuf		*sc_tx_m;
+	int			 sc_tx_maxdgrams;
+	int			 sc_tx_div;	/* wNtbOutDivisor */
+	int			 sc_tx_rem;	/* wNtbOutPayloadRemainder */
+	int			 sc_tx_ndpoffs;	/* NTH rounded to wNtbOutAlignment */
+	int			 sc_tx_mps;	/* wMaxPacketSize of bulk-OUT */
+	callout_t		 sc_tx_timer;	/* coalescing hold timer */
+	int			 sc_tx_flush;	/* hold expired, send now */
+	sbintime_t		 sc_tx_last;	/* last packet arrival */
+	u_int			 sc_tx_gap;	/* avg. inter-arrival time, usec */
+	u_int			 sc_tx_qbytes;	/* bytes on sc_tx_br */
+	int			 sc_tx_nbytes;	/* bytes in submitted NTBs */
+	sbintime_t		 sc_tx_lastdone; /* last TX completion */
+	uint64_t		 sc_tx_rate;	/* drain rate, bytes/s */
 	uint32_t		 sc_tx_seq;
+	struct mbuf		*sc_tx_tsom;	/* TSO packet partially sent */
+	int			 sc_tx_tsoff;	/* its next segment */
+
+	struct umb_fqs		 sc_fq;		/* FQ-CoDel on the bulk lane */
+	uint32_t		 sc_fq_seed;
+
+	callout_t		 sc_tx_shape_timer;
+	int64_t			 sc_tx_tbrate;	/* shaper rate, bytes/s */
+	int64_t			 sc_tx_tokens;	/* bytes */
+	sbintime_t		 sc_tx_tblast;
+	int64_t			 sc_tx_tbmax;	/* autorate ceiling, bytes/s */
+	sbintime_t		 sc_tx_arlast;	/* last autorate change */
+	int			 sc_tx_arlimited; /* shaper waited since */
+	struct mtx		 sc_ackf_mtx;
+	struct umb_ackf		 sc_ackf[UMB_ACKF_SIZE];
+
+	int			 sc_compr_sent;	/* CONNECT asked for compression */
+	callout_t		 sc_stats_timer;
+	int			 sc_stats_due;	/* query from umb_state_task() */
+	int			 sc_stats_valid;
+	uint64_t		 sc_stats_in;	/* last modem counters */
+	uint64_t		 sc_stats_out;
+	uint64_t		 sc_stats_hin;	/* interface counters then */
+	uint64_t		 sc_stats_hout;
 
 	uint32_t		 sc_tid;
 
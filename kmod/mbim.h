@@ -585,7 +585,11 @@ struct mbim_cid_packet_statistics_info {
 } __packed;
 
 
-#ifdef _KERNEL
+/*
+ * Userland that includes <dev/usb/usb.h> may ask for these with
+ * MBIM_WANT_NCM, see umb_ntb.c.
+ */
+#if defined(_KERNEL) || defined(MBIM_WANT_NCM)
 
 struct mbim_descriptor {
 	uByte	bLength;
@@ -599,12 +603,18 @@ struct mbim_descriptor {
 	uByte	bMaxFilterSize;
 	uWord	wMaxSegmentSize;
 	uByte	bmNetworkCapabilities;
+#define MBIM_NETCAP_NTBINPUTSIZE8	0x20	/* 8 byte {Get,Set}NtbInputSize */
 } __packed;
 
 /*
  * NCM Parameters
  */
 #define NCM_GET_NTB_PARAMETERS	0x80
+#define NCM_SET_NTB_FORMAT	0x84
+#define  NCM_NTB_FORMAT_16	0x0000
+#define  NCM_NTB_FORMAT_32	0x0001
+#define NCM_GET_NTB_INPUT_SIZE	0x85
+#define NCM_SET_NTB_INPUT_SIZE	0x86
 
 struct ncm_ntb_parameters {
 	uWord	wLength;
@@ -623,6 +633,13 @@ struct ncm_ntb_parameters {
 	uWord	wNtbOutMaxDatagrams;
 } __packed;
 
+/* Only the first field unless MBIM_NETCAP_NTBINPUTSIZE8 */
+struct ncm_ntb_input_size {
+	uDWord	dwNtbInMaxSize;
+	uWord	wNtbInMaxDatagrams;
+	uWord	wReserved;
+} __packed;
+
 /*
  * NCM Encoding
  */
@@ -631,6 +648,14 @@ struct ncm_ntb_parameters {
 #define MBIM_HDR32_LEN	\
 	(sizeof(struct ncm_header32) + sizeof(struct ncm_pointer32))
 
+/* NDP for n datagrams plus the null entry */
+#define MBIM_NDP16_LEN(n)						\
+	(offsetof(struct ncm_pointer16, dgram) +			\
+	 ((n) + 1) * sizeof(struct ncm_pointer16_dgram))
+#define MBIM_NDP32_LEN(n)						\
+	(offsetof(struct ncm_pointer32, dgram) +			\
+	 ((n) + 1) * sizeof(struct ncm_pointer32_dgram))
+
 struct ncm_header16 {
 #define NCM_HDR16_SIG		0x484d434e
 	uDWord	dwSignature;
@@ -692,6 +717,6 @@ struct ncm_pointer32 {
 	struct ncm_pointer32_dgram dgram[2];
 } __packed;
 
-#endif /* _KERNEL */
+#endif /* _KERNEL || MBIM_WANT_NCM */
 
 #endif /* _MBIM_H_ */
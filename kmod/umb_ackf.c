@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2016 genua mbH
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * TCP ACK filter, see umb_ackf.h. A queued pure ACK is not sent if a
+ * newer cumulative ACK for the same connection has been queued after
+ * it. The table has one slot per connection hash, holding the newest
+ * ACK queued and how many ACKs of that connection are still queued.
+ */
+
+#ifdef _KERNEL
+#ifdef _KERNEL_OPT
+#include "opt_inet.h"
+#endif
+
+#include <sys/param.h>
+#include <sys/hash.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#else
+#include <sys/types.h>
+#include <sys/hash.h>
+#include <sys/socket.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#define KASSERT(x)	assert(x)
+#define INET
+#define INET6
+#endif
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_seq.h>
+#ifdef INET6
+#include <netinet/ip6.h>
+#endif
+
+#include "umb_ackf.h"
+
+/*
+ * Check whether the first len bytes of a packet of pktlen bytes are a
+ * pure ACK and return its connection and th_ack if so. Only ACKs
+ * without data, without SYN, FIN, RST, PSH, URG, ECE and CWR, and with
+ * no options but timestamps qualify. Duplicate ACKs are always sent,
+ * as are ACKs carrying SACK blocks or ECN feedback.
+ */
+int
+umb_ackf_parse(const uint8_t *p, int len, int pktlen,
+    struct umb_ackf_key *key, uint32_t *ack)
+{
+#ifdef INET
+	const struct ip *ip;
+#endif
+#ifdef INET6
+	const struct ip6_hdr *ip6;
+#endif
+	const struct tcphdr *th;
+	const uint8_t *opt;
+	int	 hlen, optlen, i;
+
+	if (len < 1)
+		return 0;
+	memset(key, 0, sizeof(*key));
+	switch (p[0] >> 4) {
+#ifdef INET
+	case IPVERSION:
+		if (len < sizeof(*ip))
+			return 0;
+		ip = (const struct ip *)p;
+		if (ip->ip_hl != sizeof(*ip) >> 2 || ip->ip_p != IPPROTO_TCP ||
+		    (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) != 0)
+			return 0;
+		hlen = sizeof(*ip);
+		key->ak_af = AF_INET;
+		memcpy(key->ak_src, &ip->ip_src, sizeof(ip->ip_src));
+		memcpy(key->ak_dst, &ip->ip_dst, sizeof(ip->ip_dst));
+		break;
+#endif
+#ifdef INET6
+	case IPV6_VERSION >> 4:
+		if (len < sizeof(*ip6))
+			return 0;
+		ip6 = (const struct ip6_hdr *)p;
+		if (ip6->ip6_nxt != IPPROTO_TCP)
+			return 0;
+		hlen = sizeof(*ip6);
+		key->ak_af = AF_INET6;
+		memcpy(key->ak_src, &ip6->ip6_src, sizeof(ip6->ip6_src));
+		memcpy(key->ak_dst, &ip6->ip6_dst, sizeof(ip6->ip6_dst));
+		break;
+#endif
+	default:
+		return 0;
+	}
+
+	if (len < hlen + sizeof(*th))
+		return 0;
+	th = (const struct tcphdr *)(p + hlen);
+	hlen += th->th_off << 2;
+	optlen = (th->th_off << 2) - (int)sizeof(*th);
+	if (optlen < 0 || len < hlen || pktlen != hlen ||
+	    th->th_flags != TH_ACK)
+		return 0;
+
+	opt = (const uint8_t *)(th + 1);
+	for (i = 0; i < optlen; ) {
+		if (opt[i] == TCPOPT_EOL)
+			break;
+		else if (opt[i] == TCPOPT_NOP)
+			i++;
+		else if (opt[i] == TCPOPT_TIMESTAMP &&
+		    i + TCPOLEN_TIMESTAMP <= optlen &&
+		    opt[i + 1] == TCPOLEN_TIMESTAMP)
+			i += TCPOLEN_TIMESTAMP;
+		else
+			return 0;
+	}
+
+	key->ak_sport = th->th_sport;
+	key->ak_dport = th->th_dport;
+	*ack = ntohl(th->th_ack);
+	return 1;
+}
+
+static struct umb_ackf *
+umb_ackf_lookup(struct umb_ackf *tab, const struct umb_ackf_key *key)
+{
+	return &tab[hash32_buf(key, sizeof(*key), 0) & (UMB_ACKF_SIZE - 1)];
+}
+
+/*
+ * The slot of a connection, or NULL if another connection has ACKs
+ * queued in it. Such a slot is not taken over, the ACK is then sent
+ * without being tracked.
+ */
+struct umb_ackf *
+umb_ackf_slot(struct umb_ackf *tab, const struct umb_ackf_key *key)
+{
+	struct umb_ackf *af;
+
+	af = umb_ackf_lookup(tab, key);
+	if (af->af_pending > 0 &&
+	    memcmp(&af->af_key, key, sizeof(*key)) != 0)
+		return NULL;
+	return af;
+}
+
+/* Record an ACK queued in the slot umb_ackf_slot() returned */
+void
+umb_ackf_add(struct umb_ackf *af, const struct umb_ackf_key *key,
+    uint32_t ack)
+{
+	if (af->af_pending == 0 || SEQ_GT(ack, af->af_ack))
+		af->af_ack = ack;
+	af->af_key = *key;
+	af->af_pending++;
+}
+
+/*
+ * Forget a recorded ACK that leaves the queue. Returns 1 if a newer
+ * one of the same connection has been queued after it.
+ */
+int
+umb_ackf_remove(struct umb_ackf *tab, const struct umb_ackf_key *key,
+    uint32_t ack)
+{
+	struct umb_ackf *af;
+
+	af = umb_ackf_lookup(tab, key);
+	KASSERT(af->af_pending > 0 &&
+	    memcmp(&af->af_key, key, sizeof(*key)) == 0);
+	af->af_pending--;
+	return SEQ_GT(af->af_ack, ack);
+}
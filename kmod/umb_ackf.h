@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2016 genua mbH
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * TCP ACK filter: the newest queued pure ACK per connection. The
+ * parser and the table know nothing of mbufs, queues or locks, so they
+ * build in userland too, see tests/ackf. The caller serializes access
+ * to the table.
+ */
+#ifndef _UMB_ACKF_H_
+#define _UMB_ACKF_H_
+
+#define UMB_ACKF_SIZE		64	/* a power of 2 */
+
+struct umb_ackf_key {
+	uint8_t			 ak_src[16];
+	uint8_t			 ak_dst[16];
+	uint16_t		 ak_sport;
+	uint16_t		 ak_dport;
+	int			 ak_af;
+};
+
+struct umb_ackf {
+	struct umb_ackf_key	 af_key;
+	uint32_t		 af_ack;	/* newest th_ack */
+	int			 af_pending;	/* ACKs queued, 0 = slot free */
+};
+
+int	umb_ackf_parse(const uint8_t *, int, int, struct umb_ackf_key *,
+	    uint32_t *);
+struct umb_ackf *umb_ackf_slot(struct umb_ackf *,
+	    const struct umb_ackf_key *);
+void	umb_ackf_add(struct umb_ackf *, const struct umb_ackf_key *,
+	    uint32_t);
+int	umb_ackf_remove(struct umb_ackf *, const struct umb_ackf_key *,
+	    uint32_t);
+
+#endif /* _UMB_ACKF_H_ */
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2016 genua mbH
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * FQ-CoDel (RFC 8290), see umb_fq.h. Packets are put on one of
+ * UMB_FQ_FLOWS queues by the flow the caller picked. New flows are
+ * served before old ones, with deficit round robin between flows, and
+ * CoDel (RFC 8289) on each queue drops or ECN marks packets whose
+ * sojourn time stays above fs_target. The sojourn time is taken from
+ * UMB_TX_STAMP(), the time the packet was handed to the driver.
+ */
+
+#ifdef _KERNEL
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/mbuf.h>
+#include <sys/queue.h>
+#else
+#include <sys/param.h>
+#include <sys/mbuf.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#define KASSERT(x)	assert(x)
+#endif
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include "umb_fq.h"
+
+static struct mbuf *umb_fq_head(struct umb_fqs *, struct umb_fq *,
+		    int64_t, int *);
+static struct mbuf *umb_fq_codel(struct umb_fqs *, struct umb_fq *,
+		    int64_t);
+static void	 umb_fq_drop(struct umb_fqs *, struct umb_fq *);
+static int	 umb_fq_mark(struct mbuf *);
+
+/* Empty all flows. The counters are kept. */
+void
+umb_fq_init(struct umb_fqs *fs)
+{
+	struct umb_fq *fq;
+	int	 i;
+
+	TAILQ_INIT(&fs->fs_new);
+	TAILQ_INIT(&fs->fs_old);
+	for (i = 0; i < UMB_FQ_FLOWS; i++) {
+		fq = &fs->fs_fq[i];
+		fq->fq_head = fq->fq_tail = NULL;
+		fq->fq_list = UMB_FQ_IDLE;
+		fq->fq_deficit = 0;
+		fq->fq_qlen = fq->fq_backlog = 0;
+		fq->fq_first_above = fq->fq_drop_next = 0;
+		fq->fq_count = fq->fq_lastcount = 0;
+		fq->fq_dropping = 0;
+	}
+	fs->fs_cur = NULL;
+	fs->fs_qlen = 0;
+}
+
+/* Queue a packet on a flow, not between peek and remove */
+void
+umb_fq_enqueue(struct umb_fqs *fs, struct mbuf *m, u_int flow)
+{
+	struct umb_fq *fq, *fat;
+	int	 i;
+
+	KASSERT(fs->fs_cur == NULL);
+	fq = &fs->fs_fq[flow % UMB_FQ_FLOWS];
+	m->m_nextpkt = NULL;
+	if (fq->fq_tail == NULL)
+		fq->fq_head = m;
+	else
+		fq->fq_tail->m_nextpkt = m;
+	fq->fq_tail = m;
+	fq->fq_qlen++;
+	fq->fq_backlog += m->m_pkthdr.len;
+	fs->fs_qlen++;
+	if (fq->fq_list == UMB_FQ_IDLE) {
+		TAILQ_INSERT_TAIL(&fs->fs_new, fq, fq_link);
+		fq->fq_list = UMB_FQ_NEW;
+		fq->fq_deficit = fs->fs_quantum;
+	}
+
+	/* Over the limit: drop from the flow with the largest backlog */
+	if (fs->fs_qlen > fs->fs_limit) {
+		fat = &fs->fs_fq[0];
+		for (i = 1; i < UMB_FQ_FLOWS; i++)
+			if (fs->fs_fq[i].fq_backlog > fat->fq_backlog)
+				fat = &fs->fs_fq[i];
+		umb_fq_drop(fs, fat);
+	}
+}
+
+/*
+ * Pick the flow to send from next and return its head packet, now
+ * being the time in usec. The flow is remembered in fs_cur, so the
+ * next call returns the same packet unless umb_fq_remove() has been
+ * called.
+ */
+struct mbuf *
+umb_fq_peek(struct umb_fqs *fs, int64_t now)
+{
+	struct umb_fq *fq;
+	struct mbuf *m;
+
+	if (fs->fs_cur != NULL)
+		return fs->fs_cur->fq_head;
+
+	for (;;) {
+		if ((fq = TAILQ_FIRST(&fs->fs_new)) == NULL &&
+		    (fq = TAILQ_FIRST(&fs->fs_old)) == NULL)
+			return NULL;
+
+		if (fq->fq_deficit <= 0) {
+			fq->fq_deficit += fs->fs_quantum;
+			if (fq->fq_list == UMB_FQ_NEW)
+				TAILQ_REMOVE(&fs->fs_new, fq, fq_link);
+			else
+				TAILQ_REMOVE(&fs->fs_old, fq, fq_link);
+			TAILQ_INSERT_TAIL(&fs->fs_old, fq, fq_link);
+			fq->fq_list = UMB_FQ_OLD;
+			continue;
+		}
+
+		if ((m = umb_fq_codel(fs, fq, now)) == NULL) {
+			/* An emptied new flow goes to the old list once */
+			if (fq->fq_list == UMB_FQ_NEW) {
+				TAILQ_REMOVE(&fs->fs_new, fq, fq_link);
+				TAILQ_INSERT_TAIL(&fs->fs_old, fq, fq_link);
+				fq->fq_list = UMB_FQ_OLD;
+			} else {
+				TAILQ_REMOVE(&fs->fs_old, fq, fq_link);
+				fq->fq_list = UMB_FQ_IDLE;
+			}
+			continue;
+		}
+		fs->fs_cur = fq;
+		return m;
+	}
+}
+
+/* Remove the packet returned by umb_fq_peek() */
+void
+umb_fq_remove(struct umb_fqs *fs, struct mbuf *m)
+{
+	struct umb_fq *fq = fs->fs_cur;
+
+	KASSERT(fq != NULL && fq->fq_head == m);
+	if ((fq->fq_head = m->m_nextpkt) == NULL)
+		fq->fq_tail = NULL;
+	m->m_nextpkt = NULL;
+	fq->fq_deficit -= m->m_pkthdr.len;
+	fq->fq_qlen--;
+	fq->fq_backlog -= m->m_pkthdr.len;
+	fq->fq_pkts++;
+	fq->fq_bytes += m->m_pkthdr.len;
+	fs->fs_qlen--;
+	fs->fs_cur = NULL;
+}
+
+/*
+ * Head packet of a flow, and in *ok whether its sojourn time has been
+ * above target for at least an interval. A flow with no more than a
+ * quantum queued is left alone.
+ */
+static struct mbuf *
+umb_fq_head(struct umb_fqs *fs, struct umb_fq *fq, int64_t now, int *ok)
+{
+	struct mbuf *m;
+	int64_t	 sojourn;
+
+	*ok = 0;
+	if ((m = fq->fq_head) == NULL) {
+		fq->fq_first_above = 0;
+		return NULL;
+	}
+	sojourn = now - UMB_TX_STAMP(m) / SBT_1US;
+	if (sojourn < fs->fs_target || fq->fq_backlog <= fs->fs_quantum)
+		fq->fq_first_above = 0;
+	else if (fq->fq_first_above == 0)
+		fq->fq_first_above = now + fs->fs_interval;
+	else if (now >= fq->fq_first_above)
+		*ok = 1;
+	return m;
+}
+
+/*
+ * The CoDel dequeue logic. Drops or marks packets at the head of the
+ * flow and returns the packet to send, which stays queued.
+ */
+static struct mbuf *
+umb_fq_codel(struct umb_fqs *fs, struct umb_fq *fq, int64_t now)
+{
+	struct mbuf *m;
+	u_int	 delta;
+	int	 ok;
+
+	m = umb_fq_head(fs, fq, now, &ok);
+	if (m == NULL) {
+		fq->fq_dropping = 0;
+		return NULL;
+	}
+
+	if (fq->fq_dropping) {
+		if (!ok) {
+			fq->fq_dropping = 0;
+			return m;
+		}
+		while (now >= fq->fq_drop_next && fq->fq_dropping) {
+			fq->fq_count++;
+			if (umb_fq_mark(m)) {
+				fq->fq_marks++;
+				fq->fq_drop_next = umb_fq_control(
+				    fq->fq_drop_next, fq->fq_count,
+				    fs->fs_interval);
+				return m;
+			}
+			umb_fq_drop(fs, fq);
+			m = umb_fq_head(fs, fq, now, &ok);
+			if (!ok)
+				fq->fq_dropping = 0;
+			else
+				fq->fq_drop_next = umb_fq_control(
+				    fq->fq_drop_next, fq->fq_count,
+				    fs->fs_interval);
+		}
+	} else if (ok) {
+		if (umb_fq_mark(m))
+			fq->fq_marks++;
+		else {
+			umb_fq_drop(fs, fq);
+			m = umb_fq_head(fs, fq, now, &ok);
+		}
+		fq->fq_dropping = 1;
+		delta = fq->fq_count - fq->fq_lastcount;
+		if (delta > 1 && now - fq->fq_drop_next < 16 * fs->fs_interval)
+			fq->fq_count = delta;
+		else
+			fq->fq_count = 1;
+		fq->fq_drop_next = umb_fq_control(now, fq->fq_count,
+		    fs->fs_interval);
+		fq->fq_lastcount = fq->fq_count;
+	}
+	return m;
+}
+
+/* Drop the head packet of a flow, the caller's fs_drop frees it */
+static void
+umb_fq_drop(struct umb_fqs *fs, struct umb_fq *fq)
+{
+	struct mbuf *m = fq->fq_head;
+
+	KASSERT(m != NULL && fq != fs->fs_cur);
+	if ((fq->fq_head = m->m_nextpkt) == NULL)
+		fq->fq_tail = NULL;
+	m->m_nextpkt = NULL;
+	fq->fq_qlen--;
+	fq->fq_backlog -= m->m_pkthdr.len;
+	fq->fq_drops++;
+	fs->fs_qlen--;
+	fs->fs_drop(fs->fs_arg, m);
+}
+
+/* Set ECN CE on an ECN capable packet, returns 0 if it is not */
+static int
+umb_fq_mark(struct mbuf *m)
+{
+	struct ip *ip;
+	uint8_t	*p = mtod(m, uint8_t *);
+	uint16_t ow, nw;
+	uint32_t sum;
+
+	if (m->m_len >= sizeof(struct ip) && (p[0] >> 4) == 4) {
+		ip = (struct ip *)p;
+		if ((ip->ip_tos & IPTOS_ECN_MASK) == IPTOS_ECN_NOTECT)
+			return 0;
+		/* RFC 1624 incremental checksum update */
+		memcpy(&ow, ip, sizeof(ow));
+		ip->ip_tos |= IPTOS_ECN_CE;
+		memcpy(&nw, ip, sizeof(nw));
+		sum = (uint16_t)~ip->ip_sum + (uint16_t)~ow + nw;
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+		ip->ip_sum = ~sum;
+		return 1;
+	}
+	if (m->m_len >= 2 && (p[0] >> 4) == 6) {
+		/* ECN field in the traffic class */
+		if (((p[1] >> 4) & IPTOS_ECN_MASK) == IPTOS_ECN_NOTECT)
+			return 0;
+		p[1] |= IPTOS_ECN_CE << 4;
+		return 1;
+	}
+	return 0;
+}
+
+/* CoDel control law: t + interval / sqrt(count) */
+int64_t
+umb_fq_control(int64_t t, u_int count, int interval)
+{
+	uint64_t x, r, b;
+
+	/* integer square root of count << 20 */
+	x = (uint64_t)count << 20;
+	r = 0;
+	for (b = 1ULL << 62; b > x; b >>= 2)
+		;
+	for (; b != 0; b >>= 2) {
+		if (x >= r + b) {
+			x -= r + b;
+			r = (r >> 1) + b;
+		} else
+			r >>= 1;
+	}
+	return t + (int64_t)interval * 1024 / MAX(r, 1);
+}
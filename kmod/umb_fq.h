@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2016 genua mbH
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * FQ-CoDel scheduler of the bulk send lane. It knows nothing of the
+ * softc, the send rings or the clock: the caller picks the flow of a
+ * packet, passes in the time, sets the parameters and is handed the
+ * packets dropped. So it builds in userland too, see tests/fq. The
+ * caller serializes access.
+ */
+#ifndef _UMB_FQ_H_
+#define _UMB_FQ_H_
+
+#define UMB_FQ_FLOWS		64	/* the same in if_umbreg.h */
+
+/* Enqueue time of a packet on the send queue, an sbintime_t */
+#define UMB_TX_STAMP(m)		((m)->m_pkthdr.PH_loc.sixtyfour[0])
+
+struct umb_fq {
+	struct mbuf		*fq_head;	/* linked by m_nextpkt */
+	struct mbuf		*fq_tail;
+	TAILQ_ENTRY(umb_fq)	 fq_link;
+#define UMB_FQ_IDLE		0
+#define UMB_FQ_NEW		1
+#define UMB_FQ_OLD		2
+	int			 fq_list;
+	int			 fq_deficit;
+
+	uint32_t		 fq_qlen;	/* packets queued */
+	uint32_t		 fq_backlog;	/* bytes queued */
+	uint64_t		 fq_pkts;	/* sent */
+	uint64_t		 fq_bytes;
+	uint64_t		 fq_drops;
+	uint64_t		 fq_marks;	/* ECN CE instead of a drop */
+
+	/* CoDel state, times in usec */
+	int64_t			 fq_first_above;
+	int64_t			 fq_drop_next;
+	u_int			 fq_count;
+	u_int			 fq_lastcount;
+	int			 fq_dropping;
+};
+TAILQ_HEAD(umb_fqlist, umb_fq);
+
+struct umb_fqs {
+	struct umb_fq		 fs_fq[UMB_FQ_FLOWS];
+	struct umb_fqlist	 fs_new;
+	struct umb_fqlist	 fs_old;
+	struct umb_fq		*fs_cur;	/* flow of the peeked packet */
+	int			 fs_qlen;
+
+	/* Set by the caller, and may change between calls */
+	int			 fs_quantum;	/* DRR bytes per round */
+	int			 fs_limit;	/* packets on all flows */
+	int			 fs_target;	/* usec */
+	int			 fs_interval;	/* usec */
+	void			(*fs_drop)(void *, struct mbuf *);
+	void			*fs_arg;
+};
+
+void	 umb_fq_init(struct umb_fqs *);
+void	 umb_fq_enqueue(struct umb_fqs *, struct mbuf *, u_int);
+struct mbuf *umb_fq_peek(struct umb_fqs *, int64_t);
+void	 umb_fq_remove(struct umb_fqs *, struct mbuf *);
+int64_t	 umb_fq_control(int64_t, u_int, int);
+
+#endif /* _UMB_FQ_H_ */
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2016 genua mbH
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Parser for received NTBs, see umb_ntb.h. Everything in an NTB comes
+ * from the device and is checked against the NTB before it is used.
+ */
+
+#ifdef _KERNEL
+#include <sys/param.h>
+#include <sys/systm.h>
+#else
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#define MBIM_WANT_NCM
+#endif
+
+#include <dev/usb/usb.h>
+
+#include "mbim.h"
+#include "umb_ntb.h"
+
+static int	 umb_ntb_ndp(struct umb_ntb *);
+
+/*
+ * Check the NTH of the len bytes at buf. Returns 0 if datagrams can be
+ * taken from it with umb_ntb_next(), -1 with nt_err set if not.
+ */
+int
+umb_ntb_init(struct umb_ntb *nt, const char *buf, uint32_t len)
+{
+	const struct ncm_header16 *hdr16;
+	const struct ncm_header32 *hdr32;
+	uint32_t hsig, blen;
+
+	memset(nt, 0, sizeof(*nt));
+	nt->nt_buf = buf;
+	nt->nt_len = len;
+	if (len < sizeof(*hdr16)) {
+		nt->nt_err = "NTB too small";
+		return -1;
+	}
+
+	hdr16 = (const struct ncm_header16 *)buf;
+	hsig = UGETDW(hdr16->dwSignature);
+	nt->nt_hlen = UGETW(hdr16->wHeaderLength);
+	if (len < nt->nt_hlen) {
+		nt->nt_err = "NTB too small";
+		return -1;
+	}
+	switch (hsig) {
+	case NCM_HDR16_SIG:
+		if (nt->nt_hlen != sizeof(*hdr16)) {
+			nt->nt_err = "bad header len for NTH16";
+			return -1;
+		}
+		blen = UGETW(hdr16->wBlockLength);
+		nt->nt_nextoff = UGETW(hdr16->wNdpIndex);
+		nt->nt_ndplen = offsetof(struct ncm_pointer16, dgram);
+		nt->nt_entlen = sizeof(struct ncm_pointer16_dgram);
+		break;
+	case NCM_HDR32_SIG:
+		if (nt->nt_hlen != sizeof(*hdr32)) {
+			nt->nt_err = "bad header len for NTH32";
+			return -1;
+		}
+		hdr32 = (const struct ncm_header32 *)buf;
+		blen = UGETDW(hdr32->dwBlockLength);
+		nt->nt_nextoff = UGETDW(hdr32->dwNdpIndex);
+		nt->nt_ndplen = offsetof(struct ncm_pointer32, dgram);
+		nt->nt_entlen = sizeof(struct ncm_pointer32_dgram);
+		nt->nt_ntb32 = 1;
+		break;
+	default:
+		nt->nt_err = "unsupported NCM header signature";
+		return -1;
+	}
+	if (len < blen) {
+		nt->nt_err = "NTB shorter than its block length";
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Return the next datagram as its offset and length in the NTB, or 0
+ * if there is none left. Entries that point outside the NTB are
+ * skipped, a bad NDP ends the NTB.
+ */
+int
+umb_ntb_next(struct umb_ntb *nt, uint32_t *doffp, uint32_t *dlenp)
+{
+	const struct ncm_pointer16_dgram *dgram16;
+	const struct ncm_pointer32_dgram *dgram32;
+	const char *p;
+	uint32_t doff, dlen;
+
+	for (;;) {
+		if (nt->nt_ptroff == 0 ||
+		    nt->nt_entoff + nt->nt_entlen > nt->nt_ptrlen) {
+			if (nt->nt_nextoff == 0 || nt->nt_err != NULL)
+				return 0;
+			if (umb_ntb_ndp(nt) != 0)
+				return 0;
+			continue;
+		}
+
+		p = nt->nt_buf + nt->nt_ptroff + nt->nt_entoff;
+		nt->nt_entoff += nt->nt_entlen;
+		if (nt->nt_ntb32) {
+			dgram32 = (const struct ncm_pointer32_dgram *)p;
+			dlen = UGETDW(dgram32->dwDatagramLen);
+			doff = UGETDW(dgram32->dwDatagramIndex);
+		} else {
+			dgram16 = (const struct ncm_pointer16_dgram *)p;
+			dlen = UGETW(dgram16->wDatagramLen);
+			doff = UGETW(dgram16->wDatagramIndex);
+		}
+
+		/* Terminating zero entry */
+		if (dlen == 0 || doff == 0) {
+			nt->nt_entoff = nt->nt_ptrlen;
+			continue;
+		}
+		if (doff < nt->nt_hlen || doff > nt->nt_len ||
+		    dlen > nt->nt_len - doff) {
+			/* Skip giant datagram but continue processing */
+			nt->nt_baddgrams++;
+			continue;
+		}
+		*doffp = doff;
+		*dlenp = dlen;
+		return 1;
+	}
+}
+
+/*
+ * Move on to the next NDP of the chain. Each must lie within the NTB,
+ * past the header, and may only be visited once, so neither a bad
+ * offset nor a loop in the chain can take us anywhere else.
+ */
+static int
+umb_ntb_ndp(struct umb_ntb *nt)
+{
+	const struct ncm_pointer16 *ptr16;
+	const struct ncm_pointer32 *ptr32;
+	uint32_t ptroff = nt->nt_nextoff, psig;
+	int	 i;
+
+	for (i = 0; i < nt->nt_nndp; i++)
+		if (nt->nt_ndpseen[i] == ptroff)
+			break;
+	if (i < nt->nt_nndp || nt->nt_nndp == UMB_RX_MAXNDP) {
+		nt->nt_err = "NDP chain loops or is too long";
+		goto bad;
+	}
+	nt->nt_ndpseen[nt->nt_nndp++] = ptroff;
+	if (ptroff < nt->nt_hlen || ptroff > nt->nt_len - nt->nt_ndplen) {
+		nt->nt_err = "bad NDP offset";
+		goto bad;
+	}
+
+	ptr16 = (const struct ncm_pointer16 *)(nt->nt_buf + ptroff);
+	psig = UGETDW(ptr16->dwSignature);
+	if (!MBIM_NCM_NTH16_ISISG(psig) && !MBIM_NCM_NTH32_ISISG(psig)) {
+		nt->nt_err = "unsupported NCM pointer signature";
+		goto bad;
+	}
+	nt->nt_ptrlen = UGETW(ptr16->wLength);
+	if (nt->nt_ptrlen < nt->nt_ndplen ||
+	    nt->nt_ptrlen > nt->nt_len - ptroff) {
+		nt->nt_err = "bad NDP len";
+		goto bad;
+	}
+	if (nt->nt_ntb32) {
+		ptr32 = (const struct ncm_pointer32 *)ptr16;
+		nt->nt_nextoff = UGETDW(ptr32->dwNextNdpIndex);
+	} else
+		nt->nt_nextoff = UGETW(ptr16->wNextNdpIndex);
+	nt->nt_ptroff = ptroff;
+	nt->nt_entoff = nt->nt_ndplen;
+	nt->nt_ndps++;
+	return 0;
+
+bad:
+	nt->nt_ndperrs++;
+	return -1;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2016 genua mbH
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * NTB parser: walks the NTH and the chain of NDPs of a received NTB
+ * and hands out the datagrams that lie within it. It knows nothing of
+ * mbufs or the softc, so it builds in userland too, see tests/ntb.
+ */
+#ifndef _UMB_NTB_H_
+#define _UMB_NTB_H_
+
+#define UMB_RX_MAXNDP		32	/* NDPs followed per NTB */
+
+struct umb_ntb {
+	const char	*nt_buf;
+	uint32_t	 nt_len;
+	uint32_t	 nt_hlen;
+	int		 nt_ntb32;
+	uint32_t	 nt_ndplen;	/* NDP up to its first entry */
+	uint32_t	 nt_entlen;	/* datagram entry */
+
+	uint32_t	 nt_ptroff;	/* current NDP, 0 before the first */
+	uint32_t	 nt_ptrlen;
+	uint32_t	 nt_entoff;	/* its next entry */
+	uint32_t	 nt_nextoff;	/* NDP after it, 0 if none */
+	uint32_t	 nt_ndpseen[UMB_RX_MAXNDP];
+	int		 nt_nndp;
+
+	uint32_t	 nt_ndps;	/* NDPs parsed */
+	uint32_t	 nt_ndperrs;	/* bad NDPs or NDP chains */
+	uint32_t	 nt_baddgrams;	/* entries out of bounds, skipped */
+	const char	*nt_err;	/* why parsing stopped, if it did */
+};
+
+int	umb_ntb_init(struct umb_ntb *, const char *, uint32_t);
+int	umb_ntb_next(struct umb_ntb *, uint32_t *, uint32_t *);
+
+#endif /* _UMB_NTB_H_ */
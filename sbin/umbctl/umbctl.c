@@ -39,6 +39,7 @@
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -83,10 +84,12 @@ static const struct umb_valdescr _umb_ber[] =
 /* prototypes */
 static int _char_to_utf16(const char * in, uint16_t * out, size_t outlen);
 static int _error(int ret, char const * format, ...);
+static int _number(char const * str, long min, long max, long * value);
 static int _umbctl(char const * ifname, int verbose, int argc, char * argv[]);
 static int _umbctl_file(char const * ifname, char const * filename, int verbose,
 		int argc, char * argv[]);
-static void _umbctl_info(char const * ifname, struct umb_info * umbi);
+static void _umbctl_info(char const * ifname, struct umb_info * umbi,
+		int verbose);
 static int _umbctl_ioctl(char const * ifname, int fd, unsigned long request,
 		struct ifreq * ifr);
 static int _umbctl_set(char const * ifname, struct umb_parameter * umbp,
@@ -139,6 +142,20 @@ static int _error(int ret, char const * format, ...)
 }
 
 
+/* number */
+static int _number(char const * str, long min, long max, long * value)
+{
+	char * p;
+
+	errno = 0;
+	*value = strtol(str, &p, 10);
+	if(str[0] == '\0' || *p != '\0' || errno != 0
+			|| *value < min || *value > max)
+		return -1;
+	return 0;
+}
+
+
 /* umbctl */
 static int _umbctl(char const * ifname, int verbose, int argc, char * argv[])
 {
@@ -172,7 +189,7 @@ static int _umbctl(char const * ifname, int verbose, int argc, char * argv[])
 			close(fd);
 			return 3;
 		}
-		_umbctl_info(ifname, &umbi);
+		_umbctl_info(ifname, &umbi, verbose);
 	}
 	if(close(fd) != 0)
 		return _error(2, "%s: %s", ifname, strerror(errno));
@@ -234,7 +251,7 @@ static int _umbctl_file(char const * ifname, char const * filename, int verbose,
 			close(fd);
 			return 3;
 		}
-		_umbctl_info(ifname, &umbi);
+		_umbctl_info(ifname, &umbi, verbose);
 	}
 	if(close(fd) != 0)
 		return _error(2, "%s: %s", ifname, strerror(errno));
@@ -243,7 +260,8 @@ static int _umbctl_file(char const * ifname, char const * filename, int verbose,
 
 
 /* umbctl_info */
-static void _umbctl_info(char const * ifname, struct umb_info * umbi)
+static void _umbctl_info(char const * ifname, struct umb_info * umbi,
+		int verbose)
 {
 	char provider[UMB_PROVIDERNAME_MAXLEN + 1];
 	char pn[UMB_PHONENR_MAXLEN + 1];
@@ -251,6 +269,8 @@ static void _umbctl_info(char const * ifname, struct umb_info * umbi)
 	char apn[UMB_APN_MAXLEN + 1];
 	char fwinfo[UMB_FWINFO_MAXLEN + 1];
 	char hwinfo[UMB_HWINFO_MAXLEN + 1];
+	struct umb_fq_stats fq;
+	int i;
 
 	_utf16_to_char(umbi->provider, UMB_PROVIDERNAME_MAXLEN,
 			provider, sizeof(provider));
@@ -273,6 +293,102 @@ static void _umbctl_info(char const * ifname, struct umb_info * umbi)
 			umbi->enable_roaming ? "allowed" : "denied",
 			apn, umbi->uplink_speed, umbi->downlink_speed,
 			fwinfo, hwinfo);
+	if(verbose > 0)
+		printf("\tTX NTBs %" PRIu64 ", datagrams %" PRIu64
+				", padding %" PRIu64 " bytes\n"
+				"\tTX hold %d usec, %" PRIu64 " timer flushes\n"
+				"\tTX queue limit %" PRIu64 " bytes, %" PRIu64
+				" drops\n",
+				umbi->tx_ntbs, umbi->tx_dgrams,
+				umbi->tx_padbytes, umbi->tx_holdtime,
+				umbi->tx_holdflush, umbi->tx_bql_limit,
+				umbi->tx_bql_hits);
+	for(i = 0; verbose > 0 && i < UMB_TX_NLANES; i++)
+		printf("\tTX %s lane: %" PRIu64 " packets, %" PRIu64 " drops, "
+				"delay avg %" PRIu64 " max %" PRIu64 " usec\n",
+				i == UMB_TX_LANE_PRIO ? "priority" : "bulk",
+				umbi->tx_lane_pkts[i], umbi->tx_lane_drops[i],
+				umbi->tx_lane_pkts[i] > 0 ? umbi->tx_lane_delay[i]
+				/ umbi->tx_lane_pkts[i] : 0,
+				umbi->tx_lane_maxdelay[i]);
+	if(verbose > 0)
+		printf("\tTX ACK filter %s, %" PRIu64 " ACKs dropped\n",
+				umbi->tx_ackfilter ? "on" : "off",
+				umbi->tx_ackdrops);
+	if(verbose > 0)
+		printf("\tTX TSO %" PRIu64 " packets, %" PRIu64 " segments\n",
+				umbi->tx_tso, umbi->tx_tsosegs);
+	if(verbose > 0)
+	{
+		memset(&fq, 0, sizeof(fq));
+		for(i = 0; i < UMB_FQ_FLOWS; i++)
+		{
+			fq.drops += umbi->tx_fq[i].drops;
+			fq.marks += umbi->tx_fq[i].marks;
+			fq.qlen += umbi->tx_fq[i].qlen;
+		}
+		printf("\tTX FQ-CoDel %s, %" PRIu64 " drops, %" PRIu64
+				" marks, %u queued\n",
+				umbi->tx_fqcodel ? "on" : "off",
+				fq.drops, fq.marks, fq.qlen);
+	}
+	if(verbose > 0)
+		printf("\tTX shaper %d%%, rate %" PRIu64 ", %" PRIu64
+				" waits\n", umbi->tx_shape,
+				umbi->tx_shaperate, umbi->tx_shapedelays);
+	if(verbose > 0 && umbi->tx_autorate)
+		printf("\tTX autorate, delay %" PRId64 " usec, baseline %"
+				PRId64 " usec\n", umbi->tx_delay,
+				umbi->tx_basedelay);
+	if(verbose > 0)
+		printf("\tcompression %s, bytes in %" PRIu64 " (modem %" PRIu64
+				"), out %" PRIu64 " (modem %" PRIu64 ")\n",
+				umbi->compression == UMB_COMPRESSION_ON ? "on"
+				: umbi->compression == UMB_COMPRESSION_REJECTED
+				? "rejected" : "off",
+				umbi->host_rxbytes, umbi->link_rxbytes,
+				umbi->host_txbytes, umbi->link_txbytes);
+	if(verbose > 0 && umbi->rx_ntbsize > 0)
+		printf("\tRX NTB size %d (device max %d), changed %" PRIu64
+				" times at connect\n", umbi->rx_ntbsize,
+				umbi->rx_ntbmax, umbi->rx_ntbresized);
+	if(verbose > 0 && umbi->rx_ring > 0)
+		printf("\tRX ring %d, %.1f posted on average, %" PRIu64
+				" of %" PRIu64 " NTBs with none left\n",
+				umbi->rx_ring, umbi->rx_ntbs > 0
+				? (double)umbi->rx_ringsum / umbi->rx_ntbs : 0.0,
+				umbi->rx_ringempty, umbi->rx_ntbs);
+	if(verbose > 0)
+		printf("\tRX %" PRIu64 " NDPs, %" PRIu64 " bad\n",
+				umbi->rx_ndps, umbi->rx_ndperrs);
+	if(verbose > 0 && umbi->rx_gropkts > 0)
+		printf("\tRX LRO %" PRIu64 " packets from %" PRIu64
+				" segments (%.1f per packet)\n",
+				umbi->rx_gropkts, umbi->rx_grosegs,
+				(double)umbi->rx_grosegs / umbi->rx_gropkts);
+	if(verbose > 0 && umbi->rx_pollswitches > 0)
+		printf("\tRX polling %s, %" PRIu64 " times, %" PRIu64
+				" passes, %" PRIu64 " out of budget\n",
+				umbi->rx_polling ? "active" : "idle",
+				umbi->rx_pollswitches, umbi->rx_pollpasses,
+				umbi->rx_pollexhausted);
+	if(verbose > 0 && umbi->rx_zerocopy)
+		printf("\tRX zero-copy, %" PRIu64 " datagrams, %" PRIu64
+				" times without a buffer, %" PRIu64
+				" NTBs copied while lent out\n",
+				umbi->rx_zcdgrams, umbi->rx_zcnobuf,
+				umbi->rx_zclent);
+	for(i = 0; verbose > 1 && i < UMB_FQ_FLOWS; i++)
+		if(umbi->tx_fq[i].pkts > 0 || umbi->tx_fq[i].qlen > 0)
+			printf("\t  flow %d: %" PRIu64 " packets, %" PRIu64
+					" bytes, %" PRIu64 " drops, %" PRIu64
+					" marks, %u queued (%u bytes)\n", i,
+					umbi->tx_fq[i].pkts,
+					umbi->tx_fq[i].bytes,
+					umbi->tx_fq[i].drops,
+					umbi->tx_fq[i].marks,
+					umbi->tx_fq[i].qlen,
+					umbi->tx_fq[i].backlog);
 }
 
 
@@ -297,6 +413,24 @@ static int _set_roaming_allow(char const *, struct umb_parameter *,
 		char const *);
 static int _set_roaming_deny(char const *, struct umb_parameter *,
 		char const *);
+static int _set_txhold(char const *, struct umb_parameter *, char const *);
+static int _set_txshape(char const *, struct umb_parameter *, char const *);
+static int _set_ackfilter_on(char const *, struct umb_parameter *,
+		char const *);
+static int _set_ackfilter_off(char const *, struct umb_parameter *,
+		char const *);
+static int _set_fqcodel_on(char const *, struct umb_parameter *,
+		char const *);
+static int _set_autorate_on(char const *, struct umb_parameter *,
+		char const *);
+static int _set_autorate_off(char const *, struct umb_parameter *,
+		char const *);
+static int _set_fqcodel_off(char const *, struct umb_parameter *,
+		char const *);
+static int _set_compression_on(char const *, struct umb_parameter *,
+		char const *);
+static int _set_compression_off(char const *, struct umb_parameter *,
+		char const *);
 
 static int _umbctl_set(char const * ifname, struct umb_parameter * umbp,
 		int argc, char * argv[])
@@ -316,6 +450,16 @@ static int _umbctl_set(char const * ifname, struct umb_parameter * umbp,
 		{ "puk", _set_puk, 1 },
 		{ "roaming", _set_roaming_allow, 0 },
 		{ "-roaming", _set_roaming_deny, 0 },
+		{ "txhold", _set_txhold, 1 },
+		{ "txshape", _set_txshape, 1 },
+		{ "ackfilter", _set_ackfilter_on, 0 },
+		{ "-ackfilter", _set_ackfilter_off, 0 },
+		{ "fqcodel", _set_fqcodel_on, 0 },
+		{ "-fqcodel", _set_fqcodel_off, 0 },
+		{ "autorate", _set_autorate_on, 0 },
+		{ "-autorate", _set_autorate_off, 0 },
+		{ "compression", _set_compression_on, 0 },
+		{ "-compression", _set_compression_off, 0 },
 	};
 	int i;
 	size_t j;
@@ -416,6 +560,108 @@ static int _set_roaming_deny(char const * ifname, struct umb_parameter * umbp,
 	return 0;
 }
 
+static int _set_txhold(char const * ifname, struct umb_parameter * umbp,
+		char const * usec)
+{
+	long l;
+
+	if(_number(usec, 0, UMB_TX_MAXHOLD, &l) != 0)
+		return _error(-1, "%s: %s", ifname, "Invalid TX hold time");
+	umbp->txholdtime = l;
+	return 0;
+}
+
+static int _set_txshape(char const * ifname, struct umb_parameter * umbp,
+		char const * percent)
+{
+	long l;
+
+	if(_number(percent, 0, UMB_TX_MAXSHAPE, &l) != 0)
+		return _error(-1, "%s: %s", ifname, "Invalid TX shaper rate");
+	umbp->txshape = l;
+	return 0;
+}
+
+static int _set_ackfilter_on(char const * ifname, struct umb_parameter * umbp,
+		char const * unused)
+{
+	(void) ifname;
+	(void) unused;
+
+	umbp->ackfilter = 1;
+	return 0;
+}
+
+static int _set_ackfilter_off(char const * ifname, struct umb_parameter * umbp,
+		char const * unused)
+{
+	(void) ifname;
+	(void) unused;
+
+	umbp->ackfilter = 0;
+	return 0;
+}
+
+static int _set_fqcodel_on(char const * ifname, struct umb_parameter * umbp,
+		char const * unused)
+{
+	(void) ifname;
+	(void) unused;
+
+	umbp->fqcodel = 1;
+	return 0;
+}
+
+static int _set_fqcodel_off(char const * ifname, struct umb_parameter * umbp,
+		char const * unused)
+{
+	(void) ifname;
+	(void) unused;
+
+	umbp->fqcodel = 0;
+	return 0;
+}
+
+static int _set_autorate_on(char const * ifname, struct umb_parameter * umbp,
+		char const * unused)
+{
+	(void) ifname;
+	(void) unused;
+
+	umbp->autorate = 1;
+	return 0;
+}
+
+static int _set_autorate_off(char const * ifname, struct umb_parameter * umbp,
+		char const * unused)
+{
+	(void) ifname;
+	(void) unused;
+
+	umbp->autorate = 0;
+	return 0;
+}
+
+static int _set_compression_on(char const * ifname,
+		struct umb_parameter * umbp, char const * unused)
+{
+	(void) ifname;
+	(void) unused;
+
+	umbp->compression = 1;
+	return 0;
+}
+
+static int _set_compression_off(char const * ifname,
+		struct umb_parameter * umbp, char const * unused)
+{
+	(void) ifname;
+	(void) unused;
+
+	umbp->compression = 0;
+	return 0;
+}
+
 
 /* umbctl_socket */
 static int _umbctl_socket(void)
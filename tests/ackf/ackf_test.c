@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2016 genua mbH
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runs the TCP ACK filter of umb(4) against fabricated packets. The
+ * send queue is modelled the way if_umb.c drives the filter: an ACK is
+ * recorded when it is queued, if its slot is free or its own, and is
+ * removed from the table when it leaves the queue, whether it is sent,
+ * dropped or purged.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "umb_ackf.h"
+
+static int	 failed;
+static const char *curtest;
+
+#define CHECK(c)	do {						\
+	if (!(c)) {							\
+		printf("%s:%d: %s: %s failed\n", __FILE__, __LINE__,	\
+		    curtest, #c);					\
+		failed++;						\
+	}								\
+} while (0)
+
+#define PKT_MAX		128
+#define QUEUE_MAX	32
+
+struct pkt {
+	uint8_t		 p_buf[PKT_MAX];
+	int		 p_len;
+	int		 p_acked;	/* recorded with the filter */
+};
+
+static struct umb_ackf	 tab[UMB_ACKF_SIZE];
+static struct pkt	 queue[QUEUE_MAX];
+static int		 qhead, qtail;
+
+/*
+ * A TCP segment over IPv4 from port sport to port dport, with th_ack
+ * ack, the given flags, optlen bytes of options from opt and dlen
+ * bytes of data.
+ */
+static void
+tcp4(struct pkt *p, uint16_t sport, uint16_t dport, uint32_t ack,
+    uint8_t flags, const uint8_t *opt, int optlen, int dlen)
+{
+	struct ip *ip = (struct ip *)p->p_buf;
+	struct tcphdr *th = (struct tcphdr *)(ip + 1);
+
+	memset(p, 0, sizeof(*p));
+	ip->ip_v = IPVERSION;
+	ip->ip_hl = sizeof(*ip) >> 2;
+	ip->ip_p = IPPROTO_TCP;
+	ip->ip_src.s_addr = htonl(0x0a000001);
+	ip->ip_dst.s_addr = htonl(0x0a000002);
+	th->th_sport = htons(sport);
+	th->th_dport = htons(dport);
+	th->th_ack = htonl(ack);
+	th->th_off = (sizeof(*th) + optlen) >> 2;
+	th->th_flags = flags;
+	if (optlen > 0)
+		memcpy(th + 1, opt, optlen);
+	p->p_len = sizeof(*ip) + sizeof(*th) + optlen + dlen;
+	ip->ip_len = htons(p->p_len);
+}
+
+static void
+tcp6(struct pkt *p, uint16_t sport, uint16_t dport, uint32_t ack,
+    uint8_t flags)
+{
+	struct ip6_hdr *ip6 = (struct ip6_hdr *)p->p_buf;
+	struct tcphdr *th = (struct tcphdr *)(ip6 + 1);
+
+	memset(p, 0, sizeof(*p));
+	ip6->ip6_vfc = IPV6_VERSION;
+	ip6->ip6_nxt = IPPROTO_TCP;
+	ip6->ip6_src.s6_addr[15] = 1;
+	ip6->ip6_dst.s6_addr[15] = 2;
+	th->th_sport = htons(sport);
+	th->th_dport = htons(dport);
+	th->th_ack = htonl(ack);
+	th->th_off = sizeof(*th) >> 2;
+	th->th_flags = flags;
+	p->p_len = sizeof(*ip6) + sizeof(*th);
+	ip6->ip6_plen = htons(sizeof(*th));
+}
+
+static int
+parse(struct pkt *p, struct umb_ackf_key *key, uint32_t *ack)
+{
+	return umb_ackf_parse(p->p_buf, p->p_len, p->p_len, key, ack);
+}
+
+/* The parts of umb_ackf_enqueue() and umb_ackf_obsolete() that count */
+static void
+enqueue(const struct pkt *p)
+{
+	struct umb_ackf_key key;
+	struct umb_ackf *af;
+	struct pkt *q;
+	uint32_t ack;
+
+	q = &queue[qtail++ % QUEUE_MAX];
+	*q = *p;
+	q->p_acked = 0;
+	if (!parse(q, &key, &ack))
+		return;
+	if ((af = umb_ackf_slot(tab, &key)) == NULL)
+		return;
+	q->p_acked = 1;
+	umb_ackf_add(af, &key, ack);
+}
+
+/* Take the head of the queue, returns 1 if the filter drops it */
+static int
+dequeue(void)
+{
+	struct umb_ackf_key key;
+	struct pkt *q;
+	uint32_t ack;
+
+	q = &queue[qhead++ % QUEUE_MAX];
+	if (!q->p_acked)
+		return 0;
+	q->p_acked = 0;
+	if (!parse(q, &key, &ack))
+		return 0;
+	return umb_ackf_remove(tab, &key, ack);
+}
+
+/* What umb_tx_purge() does: everything queued is freed */
+static void
+purge(void)
+{
+	while (qhead != qtail)
+		(void)dequeue();
+}
+
+static int
+pending(void)
+{
+	int	 i, n = 0;
+
+	for (i = 0; i < UMB_ACKF_SIZE; i++) {
+		CHECK(tab[i].af_pending >= 0);
+		n += tab[i].af_pending;
+	}
+	return n;
+}
+
+static void
+reset(void)
+{
+	memset(tab, 0, sizeof(tab));
+	qhead = qtail = 0;
+}
+
+static void
+test_parse(void)
+{
+	static const uint8_t ts[] = { TCPOPT_NOP, TCPOPT_NOP,
+	    TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP, 0, 0, 0, 1, 0, 0, 0, 2 };
+	static const uint8_t sack[] = { TCPOPT_NOP, TCPOPT_NOP,
+	    TCPOPT_SACK, 10, 0, 0, 0, 1, 0, 0, 0, 2 };
+	static const uint8_t mss[] = { TCPOPT_MAXSEG, TCPOLEN_MAXSEG,
+	    0x05, 0xb4 };
+	static const uint8_t wscale[] = { TCPOPT_NOP, TCPOPT_WINDOW,
+	    TCPOLEN_WINDOW, 7 };
+	static const uint8_t badts[] = { TCPOPT_NOP, TCPOPT_NOP,
+	    TCPOPT_TIMESTAMP, 8, 0, 0, 0, 1, 0, 0, 0, 2 };
+	static const uint8_t eol[] = { TCPOPT_EOL, TCPOPT_SACK, 0, 0 };
+	struct umb_ackf_key key, key2;
+	struct pkt p;
+	struct ip *ip = (struct ip *)p.p_buf;
+	uint32_t ack;
+
+	curtest = "parse";
+
+	tcp4(&p, 1000, 80, 12345, TH_ACK, NULL, 0, 0);
+	CHECK(parse(&p, &key, &ack) == 1 && ack == 12345);
+	CHECK(key.ak_af == AF_INET && key.ak_sport == htons(1000) &&
+	    key.ak_dport == htons(80));
+	tcp4(&p, 1000, 80, 12345, TH_ACK, ts, sizeof(ts), 0);
+	CHECK(parse(&p, &key2, &ack) == 1 && ack == 12345);
+	CHECK(memcmp(&key, &key2, sizeof(key)) == 0);
+	tcp4(&p, 1000, 80, 12345, TH_ACK, eol, sizeof(eol), 0);
+	CHECK(parse(&p, &key, &ack) == 1);
+	tcp6(&p, 1000, 80, 777, TH_ACK);
+	CHECK(parse(&p, &key, &ack) == 1 && ack == 777 &&
+	    key.ak_af == AF_INET6);
+
+	/* SACK, ECN feedback and any other option or flag are sent */
+	tcp4(&p, 1000, 80, 1, TH_ACK, sack, sizeof(sack), 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK | TH_ECE, NULL, 0, 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK | TH_CWR, NULL, 0, 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK | TH_PUSH, NULL, 0, 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK | TH_FIN, NULL, 0, 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK | TH_SYN, NULL, 0, 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK | TH_URG, NULL, 0, 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_RST, NULL, 0, 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK, mss, sizeof(mss), 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK, wscale, sizeof(wscale), 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK, badts, sizeof(badts), 0);
+	CHECK(parse(&p, &key, &ack) == 0);
+
+	/* Data, fragments, IP options, other protocols */
+	tcp4(&p, 1000, 80, 1, TH_ACK, NULL, 0, 1);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK, NULL, 0, 0);
+	ip->ip_off = htons(IP_MF);
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK, NULL, 0, 0);
+	ip->ip_hl++;
+	CHECK(parse(&p, &key, &ack) == 0);
+	tcp4(&p, 1000, 80, 1, TH_ACK, NULL, 0, 0);
+	ip->ip_p = IPPROTO_UDP;
+	CHECK(parse(&p, &key, &ack) == 0);
+
+	/* Headers beyond what is contiguous, or beyond the packet */
+	tcp4(&p, 1000, 80, 1, TH_ACK, ts, sizeof(ts), 0);
+	CHECK(umb_ackf_parse(p.p_buf, p.p_len - 1, p.p_len, &key, &ack) == 0);
+	CHECK(umb_ackf_parse(p.p_buf, sizeof(struct ip), p.p_len, &key,
+	    &ack) == 0);
+	CHECK(umb_ackf_parse(p.p_buf, 0, p.p_len, &key, &ack) == 0);
+	((struct tcphdr *)(ip + 1))->th_off = 4;
+	CHECK(parse(&p, &key, &ack) == 0);
+}
+
+static void
+test_supersede(void)
+{
+	struct pkt p;
+
+	curtest = "supersede";
+	reset();
+
+	/* Only the newest of a run of ACKs is sent */
+	tcp4(&p, 1000, 80, 100, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 200, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 300, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	CHECK(pending() == 3);
+	CHECK(dequeue() == 1);
+	CHECK(dequeue() == 1);
+	CHECK(dequeue() == 0);
+	CHECK(pending() == 0);
+
+	/* Other connections and non-ACKs in between do not matter */
+	tcp4(&p, 1000, 80, 400, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1001, 80, 900, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 450, TH_ACK, NULL, 0, 100);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 500, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	CHECK(dequeue() == 1);
+	CHECK(dequeue() == 0);
+	CHECK(dequeue() == 0);
+	CHECK(dequeue() == 0);
+	CHECK(pending() == 0);
+
+	/* An older ACK queued after a newer one is dropped itself */
+	tcp4(&p, 1000, 80, 700, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 600, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	CHECK(dequeue() == 0);
+	CHECK(dequeue() == 1);
+	CHECK(pending() == 0);
+}
+
+static void
+test_dupack(void)
+{
+	static const uint8_t sack[] = { TCPOPT_NOP, TCPOPT_NOP,
+	    TCPOPT_SACK, 10, 0, 0, 0, 1, 0, 0, 0, 2 };
+	struct pkt p;
+	int	 i;
+
+	curtest = "dupack";
+	reset();
+
+	/* Duplicate ACKs drive fast retransmit, all of them are sent */
+	for (i = 0; i < 4; i++) {
+		tcp4(&p, 1000, 80, 100, TH_ACK, NULL, 0, 0);
+		enqueue(&p);
+	}
+	for (i = 0; i < 4; i++)
+		CHECK(dequeue() == 0);
+	CHECK(pending() == 0);
+
+	/* So are ACKs with SACK blocks, even behind a newer ACK */
+	tcp4(&p, 1000, 80, 100, TH_ACK, sack, sizeof(sack), 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 200, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	CHECK(dequeue() == 0);
+	CHECK(dequeue() == 0);
+
+	/* And ECN feedback */
+	tcp4(&p, 1000, 80, 300, TH_ACK | TH_ECE, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 400, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	CHECK(dequeue() == 0);
+	CHECK(dequeue() == 0);
+	CHECK(pending() == 0);
+}
+
+static void
+test_wrap(void)
+{
+	struct pkt p;
+
+	curtest = "wrap";
+	reset();
+
+	/* 0x10 is newer than 0xfffffff0 once the sequence space wraps */
+	tcp4(&p, 1000, 80, 0xfffffff0, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 0x10, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	CHECK(dequeue() == 1);
+	CHECK(dequeue() == 0);
+
+	tcp4(&p, 1000, 80, 0x20, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 0xffffffe0, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	CHECK(dequeue() == 0);
+	CHECK(dequeue() == 1);
+
+	/* Half the space apart or more is not newer */
+	tcp4(&p, 1000, 80, 0x7fffffff, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 0x80000000, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	CHECK(dequeue() == 1);
+	CHECK(dequeue() == 0);
+	CHECK(pending() == 0);
+}
+
+static void
+test_collision(void)
+{
+	struct umb_ackf_key ka, kb;
+	struct umb_ackf *af;
+	struct pkt p;
+	uint32_t ack;
+	uint16_t sport;
+
+	curtest = "collision";
+	reset();
+
+	/* Find a second connection that hashes to the same slot */
+	tcp4(&p, 1000, 80, 1, TH_ACK, NULL, 0, 0);
+	CHECK(parse(&p, &ka, &ack) == 1);
+	af = umb_ackf_slot(tab, &ka);
+	for (sport = 1001; sport != 1000; sport++) {
+		tcp4(&p, sport, 80, 1, TH_ACK, NULL, 0, 0);
+		CHECK(parse(&p, &kb, &ack) == 1);
+		if (umb_ackf_slot(tab, &kb) == af)
+			break;
+	}
+	CHECK(sport != 1000);
+
+	/* A holds the slot, B's ACKs go out untracked, all of them */
+	tcp4(&p, 1000, 80, 100, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, sport, 80, 5000, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 200, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, sport, 80, 6000, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	CHECK(umb_ackf_slot(tab, &kb) == NULL);
+	CHECK(af->af_pending == 2 && af->af_ack == 200);
+	CHECK(dequeue() == 1);
+	CHECK(dequeue() == 0);
+	CHECK(dequeue() == 0);
+	CHECK(dequeue() == 0);
+	CHECK(pending() == 0);
+
+	/* Once A is drained, B can have the slot */
+	tcp4(&p, sport, 80, 7000, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, sport, 80, 8000, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	tcp4(&p, 1000, 80, 300, TH_ACK, NULL, 0, 0);
+	enqueue(&p);
+	CHECK(af->af_pending == 2 && af->af_ack == 8000);
+	CHECK(dequeue() == 1);
+	CHECK(dequeue() == 0);
+	CHECK(dequeue() == 0);
+	CHECK(pending() == 0);
+}
+
+static void
+test_purge(void)
+{
+	struct umb_ackf_key key;
+	struct pkt p;
+	uint32_t ack;
+	int	 i;
+
+	curtest = "purge";
+	reset();
+
+	/* A purge with a mix of tracked and untracked packets queued */
+	for (i = 0; i < 20; i++) {
+		tcp4(&p, 1000 + i % 5, 80, 100 + i, TH_ACK, NULL, 0,
+		    i % 3 == 0 ? 10 : 0);
+		enqueue(&p);
+	}
+	CHECK(pending() > 0);
+	for (i = 0; i < 7; i++)
+		(void)dequeue();
+	purge();
+	CHECK(pending() == 0);
+
+	/* Nothing left over: the next ACK of each connection is sent */
+	for (i = 0; i < 5; i++) {
+		tcp4(&p, 1000 + i, 80, 50, TH_ACK, NULL, 0, 0);
+		enqueue(&p);
+		CHECK(parse(&p, &key, &ack) == 1);
+		CHECK(umb_ackf_slot(tab, &key)->af_ack == 50);
+	}
+	for (i = 0; i < 5; i++)
+		CHECK(dequeue() == 0);
+	CHECK(pending() == 0);
+}
+
+int
+main(void)
+{
+	test_parse();
+	test_supersede();
+	test_dupack();
+	test_wrap();
+	test_collision();
+	test_purge();
+	if (failed) {
+		printf("%d checks failed\n", failed);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
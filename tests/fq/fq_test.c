@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2016 genua mbH
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runs the FQ-CoDel scheduler of umb(4) on a simulated clock. Checks
+ * the CoDel control law, when packets are dropped or ECN marked
+ * against their sojourn time, and that deficit round robin gives each
+ * backlogged flow a quantum of bytes per round.
+ */
+
+#include <sys/param.h>
+#include <sys/mbuf.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "umb_fq.h"
+
+static int	 failed;
+static const char *curtest;
+
+#define CHECK(c)	do {						\
+	if (!(c)) {							\
+		printf("%s:%d: %s: %s failed\n", __FILE__, __LINE__,	\
+		    curtest, #c);					\
+		failed++;						\
+	}								\
+} while (0)
+
+#define TARGET		5000
+#define INTERVAL	100000
+#define QUANTUM		1500
+#define NPKTS		256
+
+static struct umb_fqs	 fs;
+static struct mbuf	 pkts[NPKTS];
+static char		 bufs[NPKTS][QUANTUM];
+static int		 npkts;
+static struct mbuf	*dropped[NPKTS];
+static int		 ndropped;
+
+static void
+drop(void *arg, struct mbuf *m)
+{
+	CHECK(arg == &fs);
+	dropped[ndropped++] = m;
+}
+
+static void
+reset(void)
+{
+	memset(&fs, 0, sizeof(fs));
+	umb_fq_init(&fs);
+	fs.fs_quantum = QUANTUM;
+	fs.fs_limit = NPKTS;
+	fs.fs_target = TARGET;
+	fs.fs_interval = INTERVAL;
+	fs.fs_drop = drop;
+	fs.fs_arg = &fs;
+	npkts = ndropped = 0;
+}
+
+/* One's complement sum over an IPv4 header */
+static uint16_t
+cksum(const struct ip *ip)
+{
+	const uint16_t *w = (const uint16_t *)ip;
+	uint32_t sum = 0;
+	size_t	 i;
+
+	for (i = 0; i < sizeof(*ip) / 2; i++)
+		sum += w[i];
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* Queue an IPv4 packet of len bytes and ECN field ecn, stamped at t */
+static struct mbuf *
+pkt(u_int flow, int len, int64_t t, int ecn)
+{
+	struct mbuf *m = &pkts[npkts];
+	struct ip *ip = (struct ip *)bufs[npkts];
+
+	npkts++;
+	memset(m, 0, sizeof(*m));
+	memset(ip, 0, sizeof(*ip));
+	ip->ip_v = IPVERSION;
+	ip->ip_hl = sizeof(*ip) >> 2;
+	ip->ip_tos = ecn;
+	ip->ip_len = htons(len);
+	ip->ip_ttl = 64;
+	ip->ip_p = IPPROTO_UDP;
+	ip->ip_sum = ~cksum(ip);
+	m->m_data = (char *)ip;
+	m->m_len = len;
+	m->m_pkthdr.len = len;
+	UMB_TX_STAMP(m) = t * SBT_1US;
+	umb_fq_enqueue(&fs, m, flow);
+	return m;
+}
+
+/* Send the next packet at now, NULL if there is none */
+static struct mbuf *
+xmit(int64_t now)
+{
+	struct mbuf *m;
+
+	if ((m = umb_fq_peek(&fs, now)) != NULL)
+		umb_fq_remove(&fs, m);
+	return m;
+}
+
+static void
+test_control(void)
+{
+	int64_t	 d, prev;
+	u_int	 count;
+
+	curtest = "control";
+
+	CHECK(umb_fq_control(0, 1, INTERVAL) == INTERVAL);
+	CHECK(umb_fq_control(12345, 1, INTERVAL) == 12345 + INTERVAL);
+	CHECK(umb_fq_control(0, 4, INTERVAL) == INTERVAL / 2);
+	CHECK(umb_fq_control(0, 16, INTERVAL) == INTERVAL / 4);
+	CHECK(umb_fq_control(0, 0, INTERVAL) > 0);
+
+	/* interval / sqrt(count), to 1%, and never growing */
+	prev = INTERVAL;
+	for (count = 1; count <= 10000; count++) {
+		d = umb_fq_control(0, count, INTERVAL);
+		CHECK(d <= prev);
+		CHECK(d * d * count >= (int64_t)INTERVAL * INTERVAL * 98 / 100);
+		CHECK(d * d * count <= (int64_t)INTERVAL * INTERVAL * 102 / 100);
+		prev = d;
+	}
+}
+
+static void
+test_drop(void)
+{
+	int64_t	 t, next;
+	int	 i;
+
+	curtest = "drop";
+	reset();
+
+	for (i = 0; i < 12; i++)
+		pkt(0, 1000, 0, IPTOS_ECN_NOTECT);
+
+	/* Below target, then above for less than an interval */
+	CHECK(xmit(TARGET - 1) == &pkts[0]);
+	CHECK(xmit(10000) == &pkts[1]);
+	t = 10000 + INTERVAL;
+	CHECK(xmit(t - 1) == &pkts[2]);
+	CHECK(ndropped == 0);
+
+	/* An interval above target: the head is dropped */
+	CHECK(xmit(t) == &pkts[4]);
+	CHECK(ndropped == 1 && dropped[0] == &pkts[3]);
+
+	/* Then one drop each interval / sqrt(count) */
+	next = umb_fq_control(t, 1, INTERVAL);
+	CHECK(xmit(next - 1) == &pkts[5]);
+	CHECK(ndropped == 1);
+	CHECK(xmit(next) == &pkts[7]);
+	CHECK(ndropped == 2 && dropped[1] == &pkts[6]);
+	next = umb_fq_control(next, 2, INTERVAL);
+	CHECK(next - t < 2 * INTERVAL);
+	CHECK(xmit(next - 1) == &pkts[8]);
+	CHECK(ndropped == 2);
+	CHECK(xmit(next) == &pkts[10]);
+	CHECK(ndropped == 3 && dropped[2] == &pkts[9]);
+	CHECK(fs.fs_fq[0].fq_dropping && fs.fs_fq[0].fq_count == 3);
+
+	/* Below target again: dropping ends */
+	for (i = 0; i < 4; i++)
+		pkt(0, 1000, 300000, IPTOS_ECN_NOTECT);
+	CHECK(xmit(303000) == &pkts[11]);
+	CHECK(xmit(303000) == &pkts[12]);
+	CHECK(!fs.fs_fq[0].fq_dropping);
+	CHECK(xmit(400000) == &pkts[13]);
+	CHECK(ndropped == 3);
+	CHECK(fs.fs_fq[0].fq_drops == 3 && fs.fs_fq[0].fq_pkts == 11);
+	CHECK(fs.fs_qlen == 2 && fs.fs_fq[0].fq_qlen == 2);
+}
+
+static void
+test_mark(void)
+{
+	struct mbuf *m;
+	struct ip *ip;
+	int64_t	 t;
+	int	 i;
+
+	curtest = "mark";
+	reset();
+
+	/* ECN capable packets are marked CE instead of dropped */
+	for (i = 0; i < 8; i++)
+		pkt(0, 1000, 0, IPTOS_ECN_ECT0);
+	CHECK(xmit(10000) == &pkts[0]);
+	t = 10000 + INTERVAL;
+	CHECK((m = xmit(t)) == &pkts[1]);
+	ip = mtod(m, struct ip *);
+	CHECK((ip->ip_tos & IPTOS_ECN_MASK) == IPTOS_ECN_CE);
+	CHECK(cksum(ip) == 0xffff);
+	CHECK((m = xmit(t)) == &pkts[2]);
+	CHECK((mtod(m, struct ip *)->ip_tos & IPTOS_ECN_MASK) ==
+	    IPTOS_ECN_ECT0);
+	CHECK((m = xmit(umb_fq_control(t, 1, INTERVAL))) == &pkts[3]);
+	CHECK((mtod(m, struct ip *)->ip_tos & IPTOS_ECN_MASK) ==
+	    IPTOS_ECN_CE);
+	CHECK(ndropped == 0 && fs.fs_fq[0].fq_marks == 2);
+}
+
+static void
+test_backlog(void)
+{
+	int	 i;
+
+	curtest = "backlog";
+
+	/* No more than a quantum queued is never dropped */
+	reset();
+	for (i = 0; i < 3; i++)
+		pkt(0, 500, 0, IPTOS_ECN_NOTECT);
+	CHECK(xmit(10000) == &pkts[0]);
+	CHECK(xmit(10000 + INTERVAL) == &pkts[1]);
+	CHECK(ndropped == 0);
+
+	/* More than that is */
+	reset();
+	for (i = 0; i < 4; i++)
+		pkt(0, 600, 0, IPTOS_ECN_NOTECT);
+	CHECK(xmit(10000) == &pkts[0]);
+	CHECK(xmit(10000 + INTERVAL) == &pkts[2]);
+	CHECK(ndropped == 1);
+}
+
+static void
+test_drr(void)
+{
+	struct mbuf *m;
+	int	 bytes[3], i, j;
+
+	curtest = "drr";
+	reset();
+	fs.fs_target = INT32_MAX;
+
+	/* Flow 1 with full size packets, flow 2 with a third of that */
+	for (i = 0; i < 20; i++)
+		pkt(1, QUANTUM, 0, IPTOS_ECN_NOTECT);
+	for (i = 0; i < 60; i++)
+		pkt(2, QUANTUM / 3, 0, IPTOS_ECN_NOTECT);
+
+	/* A quantum per round each: one packet, then three */
+	memset(bytes, 0, sizeof(bytes));
+	for (i = 0; i < 10; i++) {
+		m = xmit(0);
+		CHECK(m >= &pkts[0] && m < &pkts[20]);
+		bytes[1] += m->m_pkthdr.len;
+		for (j = 0; j < 3; j++) {
+			m = xmit(0);
+			CHECK(m >= &pkts[20] && m < &pkts[80]);
+			bytes[2] += m->m_pkthdr.len;
+		}
+		CHECK(bytes[1] == bytes[2]);
+	}
+
+	/* A new flow goes ahead of the old ones */
+	m = xmit(0);
+	CHECK(m >= &pkts[0] && m < &pkts[20]);
+	m = pkt(3, 100, 0, IPTOS_ECN_NOTECT);
+	CHECK(xmit(0) == m);
+	m = xmit(0);
+	CHECK(m >= &pkts[20] && m < &pkts[80]);
+
+	/* The quantum is picked up again each round */
+	fs.fs_quantum = 2 * QUANTUM;
+	memset(bytes, 0, sizeof(bytes));
+	for (i = 0; i < 12; i++) {
+		m = xmit(0);
+		bytes[m < &pkts[20] ? 1 : 2] += m->m_pkthdr.len;
+	}
+	CHECK(bytes[1] >= QUANTUM && bytes[2] >= QUANTUM);
+	CHECK(ndropped == 0);
+}
+
+static void
+test_limit(void)
+{
+	int	 i;
+
+	curtest = "limit";
+	reset();
+	fs.fs_limit = 10;
+
+	/* Over the limit, the flow with the largest backlog loses */
+	for (i = 0; i < 8; i++)
+		pkt(1, 1000, 0, IPTOS_ECN_NOTECT);
+	for (i = 0; i < 2; i++)
+		pkt(2, 100, 0, IPTOS_ECN_NOTECT);
+	CHECK(ndropped == 0);
+	pkt(2, 100, 0, IPTOS_ECN_NOTECT);
+	CHECK(ndropped == 1 && dropped[0] == &pkts[0]);
+	CHECK(fs.fs_qlen == 10);
+	CHECK(fs.fs_fq[1].fq_qlen == 7 && fs.fs_fq[1].fq_backlog == 7000);
+	CHECK(fs.fs_fq[1].fq_drops == 1);
+
+	/* Starting over empties the flows but keeps the counters */
+	umb_fq_init(&fs);
+	CHECK(fs.fs_qlen == 0 && fs.fs_fq[1].fq_qlen == 0);
+	CHECK(fs.fs_fq[1].fq_drops == 1);
+	CHECK(xmit(0) == NULL);
+}
+
+int
+main(void)
+{
+	test_control();
+	test_drop();
+	test_mark();
+	test_backlog();
+	test_drr();
+	test_limit();
+	if (failed) {
+		printf("%d checks failed\n", failed);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
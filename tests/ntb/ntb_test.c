@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2016 genua mbH
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runs the NTB parser of umb(4) against fabricated NTBs. Built with
+ * -DFUZZ it is a libFuzzer target instead, which checks that no input
+ * gets a datagram outside the NTB handed out.
+ */
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dev/usb/usb.h>
+
+#define MBIM_WANT_NCM
+#include "mbim.h"
+#include "umb_ntb.h"
+
+#define NTB_MAXDGRAMS	(UMB_RX_MAXNDP * 64)
+
+struct walk {
+	int		 w_init;	/* umb_ntb_init() result */
+	int		 w_ndgram;
+	uint32_t	 w_doff[NTB_MAXDGRAMS];
+	uint32_t	 w_dlen[NTB_MAXDGRAMS];
+	struct umb_ntb	 w_nt;
+};
+
+/*
+ * Hand everything the parser returns to the caller, checking on the
+ * way that it lies past the header and within the NTB.
+ */
+static void
+walk(struct walk *w, const char *buf, uint32_t len)
+{
+	uint32_t doff, dlen;
+
+	memset(w, 0, sizeof(*w));
+	w->w_init = umb_ntb_init(&w->w_nt, buf, len);
+	if (w->w_init != 0) {
+		assert(w->w_nt.nt_err != NULL);
+		return;
+	}
+	while (umb_ntb_next(&w->w_nt, &doff, &dlen)) {
+		assert(doff >= w->w_nt.nt_hlen);
+		assert(dlen > 0 && doff <= len && dlen <= len - doff);
+		assert(w->w_ndgram < NTB_MAXDGRAMS);
+		w->w_doff[w->w_ndgram] = doff;
+		w->w_dlen[w->w_ndgram] = dlen;
+		w->w_ndgram++;
+	}
+	assert(w->w_nt.nt_ndps <= UMB_RX_MAXNDP);
+	/* Once done, it stays done */
+	assert(umb_ntb_next(&w->w_nt, &doff, &dlen) == 0);
+}
+
+#ifdef FUZZ
+
+int	LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static struct walk w;
+	char	*buf;
+
+	if (size > UINT16_MAX * 2)
+		return 0;
+	/* A copy of the exact size, so ASan sees any overread */
+	if ((buf = malloc(size ? size : 1)) == NULL)
+		return 0;
+	memcpy(buf, data, size);
+	walk(&w, buf, size);
+	free(buf);
+	return 0;
+}
+
+#else /* !FUZZ */
+
+static int	 failed;
+static const char *curtest;
+
+#define CHECK(c)	do {						\
+	if (!(c)) {							\
+		printf("%s:%d: %s: %s failed\n", __FILE__, __LINE__,	\
+		    curtest, #c);					\
+		failed++;						\
+	}								\
+} while (0)
+
+#define HDR16_LEN	sizeof(struct ncm_header16)
+#define HDR32_LEN	sizeof(struct ncm_header32)
+#define NDP16_LEN	offsetof(struct ncm_pointer16, dgram)
+#define NDP32_LEN	offsetof(struct ncm_pointer32, dgram)
+#define ENT16_LEN	sizeof(struct ncm_pointer16_dgram)
+#define ENT32_LEN	sizeof(struct ncm_pointer32_dgram)
+
+static char	 ntb[1024];
+
+static void
+nth16(uint16_t blen, uint16_t ndpoff)
+{
+	struct ncm_header16 *hdr = (struct ncm_header16 *)ntb;
+
+	memset(ntb, 0, sizeof(ntb));
+	USETDW(hdr->dwSignature, NCM_HDR16_SIG);
+	USETW(hdr->wHeaderLength, HDR16_LEN);
+	USETW(hdr->wBlockLength, blen);
+	USETW(hdr->wNdpIndex, ndpoff);
+}
+
+static void
+nth32(uint32_t blen, uint32_t ndpoff)
+{
+	struct ncm_header32 *hdr = (struct ncm_header32 *)ntb;
+
+	memset(ntb, 0, sizeof(ntb));
+	USETDW(hdr->dwSignature, NCM_HDR32_SIG);
+	USETW(hdr->wHeaderLength, HDR32_LEN);
+	USETDW(hdr->dwBlockLength, blen);
+	USETDW(hdr->dwNdpIndex, ndpoff);
+}
+
+/*
+ * An NDP at off with n entries from ent, each an offset and length,
+ * and a terminating zero entry.
+ */
+static void
+ndp16(uint16_t off, uint16_t next, int n, const uint16_t *ent)
+{
+	struct ncm_pointer16 *ptr = (struct ncm_pointer16 *)(ntb + off);
+	struct ncm_pointer16_dgram *dg;
+	int	 i;
+
+	USETDW(ptr->dwSignature, MBIM_NCM_NTH16_SIG(0));
+	USETW(ptr->wLength, NDP16_LEN + (n + 1) * ENT16_LEN);
+	USETW(ptr->wNextNdpIndex, next);
+	dg = (struct ncm_pointer16_dgram *)(ntb + off + NDP16_LEN);
+	for (i = 0; i < n; i++) {
+		USETW(dg[i].wDatagramIndex, ent[2 * i]);
+		USETW(dg[i].wDatagramLen, ent[2 * i + 1]);
+	}
+	USETW(dg[n].wDatagramIndex, 0);
+	USETW(dg[n].wDatagramLen, 0);
+}
+
+static void
+ndp32(uint32_t off, uint32_t next, int n, const uint32_t *ent)
+{
+	struct ncm_pointer32 *ptr = (struct ncm_pointer32 *)(ntb + off);
+	struct ncm_pointer32_dgram *dg;
+	int	 i;
+
+	USETDW(ptr->dwSignature, MBIM_NCM_NTH32_SIG(0));
+	USETW(ptr->wLength, NDP32_LEN + (n + 1) * ENT32_LEN);
+	USETDW(ptr->dwNextNdpIndex, next);
+	dg = (struct ncm_pointer32_dgram *)(ntb + off + NDP32_LEN);
+	for (i = 0; i < n; i++) {
+		USETDW(dg[i].dwDatagramIndex, ent[2 * i]);
+		USETDW(dg[i].dwDatagramLen, ent[2 * i + 1]);
+	}
+	USETDW(dg[n].dwDatagramIndex, 0);
+	USETDW(dg[n].dwDatagramLen, 0);
+}
+
+static void
+test_nth(void)
+{
+	struct walk w;
+	struct ncm_header16 *hdr = (struct ncm_header16 *)ntb;
+
+	curtest = "nth";
+	nth16(64, 0);
+	walk(&w, ntb, HDR16_LEN - 1);
+	CHECK(w.w_init != 0);
+
+	/* Header length beyond the transfer */
+	nth16(64, 0);
+	USETW(hdr->wHeaderLength, 200);
+	walk(&w, ntb, 64);
+	CHECK(w.w_init != 0);
+
+	/* Header length that does not match the signature */
+	nth16(64, 0);
+	USETW(hdr->wHeaderLength, HDR32_LEN);
+	walk(&w, ntb, 64);
+	CHECK(w.w_init != 0);
+	nth32(64, 0);
+	USETW(hdr->wHeaderLength, HDR16_LEN);
+	walk(&w, ntb, 64);
+	CHECK(w.w_init != 0);
+
+	nth16(64, 0);
+	USETDW(hdr->dwSignature, 0x12345678);
+	walk(&w, ntb, 64);
+	CHECK(w.w_init != 0);
+
+	/* Block length beyond the transfer */
+	nth16(65, 0);
+	walk(&w, ntb, 64);
+	CHECK(w.w_init != 0);
+	nth32(0x10000040, 0);
+	walk(&w, ntb, 64);
+	CHECK(w.w_init != 0);
+
+	/* No NDP at all */
+	nth16(64, 0);
+	walk(&w, ntb, 64);
+	CHECK(w.w_init == 0 && w.w_ndgram == 0 && w.w_nt.nt_ndps == 0);
+}
+
+static void
+test_ntb16(void)
+{
+	static const uint16_t ent[] = { 64, 10, 74, 20 };
+	static const uint16_t last[] = { 127, 1 };
+	struct walk w;
+
+	curtest = "ntb16";
+	nth16(128, 16);
+	ndp16(16, 0, 2, ent);
+	walk(&w, ntb, 128);
+	CHECK(w.w_init == 0);
+	CHECK(w.w_ndgram == 2);
+	CHECK(w.w_doff[0] == 64 && w.w_dlen[0] == 10);
+	CHECK(w.w_doff[1] == 74 && w.w_dlen[1] == 20);
+	CHECK(w.w_nt.nt_ndps == 1 && w.w_nt.nt_ndperrs == 0);
+	CHECK(w.w_nt.nt_err == NULL);
+
+	/* The last byte of the NTB may be used */
+	nth16(128, 16);
+	ndp16(16, 0, 1, last);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 1 && w.w_doff[0] == 127);
+}
+
+static void
+test_ntb32(void)
+{
+	static const uint32_t ent[] = { 96, 100, 196, 60 };
+	static const uint32_t big[] = { 0x10000060, 10, 96, 0xffffffff };
+	struct walk w;
+
+	curtest = "ntb32";
+	nth32(256, 16);
+	ndp32(16, 0, 2, ent);
+	walk(&w, ntb, 256);
+	CHECK(w.w_init == 0);
+	CHECK(w.w_ndgram == 2);
+	CHECK(w.w_doff[0] == 96 && w.w_dlen[0] == 100);
+	CHECK(w.w_doff[1] == 196 && w.w_dlen[1] == 60);
+	CHECK(w.w_nt.nt_ndps == 1 && w.w_nt.nt_ndperrs == 0);
+
+	/* Offsets past 64k must not wrap into the NTB */
+	nth32(256, 16);
+	ndp32(16, 0, 2, big);
+	walk(&w, ntb, 256);
+	CHECK(w.w_ndgram == 0 && w.w_nt.nt_baddgrams == 2);
+}
+
+static void
+test_chain(void)
+{
+	static const uint16_t ent1[] = { 128, 10 };
+	static const uint16_t ent2[] = { 138, 20, 158, 30 };
+	struct walk w;
+
+	curtest = "chain";
+	nth16(256, 16);
+	ndp16(16, 48, 1, ent1);
+	ndp16(48, 0, 2, ent2);
+	walk(&w, ntb, 256);
+	CHECK(w.w_ndgram == 3);
+	CHECK(w.w_doff[0] == 128 && w.w_doff[1] == 138 &&
+	    w.w_doff[2] == 158);
+	CHECK(w.w_nt.nt_ndps == 2 && w.w_nt.nt_ndperrs == 0);
+
+	/* An NDP pointing back at itself */
+	nth16(256, 16);
+	ndp16(16, 16, 1, ent1);
+	walk(&w, ntb, 256);
+	CHECK(w.w_ndgram == 1);
+	CHECK(w.w_nt.nt_ndps == 1 && w.w_nt.nt_ndperrs == 1);
+	CHECK(w.w_nt.nt_err != NULL);
+
+	/* A longer loop */
+	nth16(256, 16);
+	ndp16(16, 48, 1, ent1);
+	ndp16(48, 16, 2, ent2);
+	walk(&w, ntb, 256);
+	CHECK(w.w_ndgram == 3);
+	CHECK(w.w_nt.nt_ndps == 2 && w.w_nt.nt_ndperrs == 1);
+}
+
+static void
+test_chainlen(void)
+{
+	static const uint16_t ent[] = { 1000, 4 };
+	struct walk w;
+	int	 i;
+
+	/* One NDP more than is followed, 16 bytes apart */
+	curtest = "chainlen";
+	nth16(1024, 16);
+	for (i = 0; i <= UMB_RX_MAXNDP; i++)
+		ndp16(16 + 16 * i, i < UMB_RX_MAXNDP ? 32 + 16 * i : 0, 1,
+		    ent);
+	walk(&w, ntb, 1024);
+	CHECK(w.w_ndgram == UMB_RX_MAXNDP);
+	CHECK(w.w_nt.nt_ndps == UMB_RX_MAXNDP && w.w_nt.nt_ndperrs == 1);
+}
+
+static void
+test_badndp(void)
+{
+	static const uint16_t ent[] = { 64, 10 };
+	static const uint16_t ent2[] = { 100, 10 };
+	struct ncm_pointer16 *ptr = (struct ncm_pointer16 *)(ntb + 16);
+	struct walk w;
+
+	curtest = "badndp";
+	/* Inside the header */
+	nth16(128, 4);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 0 && w.w_nt.nt_ndperrs == 1);
+
+	/* Not enough room left for the NDP */
+	nth16(128, 128 - NDP16_LEN + 1);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 0 && w.w_nt.nt_ndperrs == 1);
+	nth16(128, 0xfff0);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 0 && w.w_nt.nt_ndperrs == 1);
+
+	nth16(128, 16);
+	ndp16(16, 0, 1, ent);
+	USETDW(ptr->dwSignature, 0x12345678);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 0 && w.w_nt.nt_ndperrs == 1);
+
+	/* NDP length shorter than its header, or past the NTB */
+	nth16(128, 16);
+	ndp16(16, 0, 1, ent);
+	USETW(ptr->wLength, NDP16_LEN - 1);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 0 && w.w_nt.nt_ndperrs == 1);
+	USETW(ptr->wLength, 128 - 16 + 1);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 0 && w.w_nt.nt_ndperrs == 1);
+
+	/* Datagrams before a bad NDP still count */
+	nth16(128, 16);
+	ndp16(16, 200, 1, ent2);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 1 && w.w_nt.nt_ndps == 1);
+	CHECK(w.w_nt.nt_ndperrs == 1);
+}
+
+static void
+test_baddgram(void)
+{
+	static const uint16_t ent[] = {
+		4, 10,		/* in the header */
+		120, 9,		/* one byte past the end */
+		129, 1,		/* starts past the end */
+		64, 10,		/* fine */
+	};
+	static const uint16_t zero[] = { 64, 0, 80, 10 };
+	static const uint16_t one[] = { 64, 10 };
+	struct ncm_pointer16 *ptr = (struct ncm_pointer16 *)(ntb + 16);
+	struct walk w;
+
+	curtest = "baddgram";
+	nth16(128, 16);
+	ndp16(16, 0, 4, ent);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 1 && w.w_doff[0] == 64);
+	CHECK(w.w_nt.nt_baddgrams == 3);
+	CHECK(w.w_nt.nt_ndperrs == 0 && w.w_nt.nt_err == NULL);
+
+	/* Nothing after the zero entry is looked at */
+	nth16(128, 16);
+	ndp16(16, 0, 2, zero);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 0 && w.w_nt.nt_baddgrams == 0);
+
+	/* A partial entry at the end of the NDP is ignored */
+	nth16(128, 16);
+	ndp16(16, 0, 1, one);
+	USETW(ptr->wLength, NDP16_LEN + ENT16_LEN + 2);
+	walk(&w, ntb, 128);
+	CHECK(w.w_ndgram == 1);
+}
+
+int
+main(void)
+{
+	test_nth();
+	test_ntb16();
+	test_ntb32();
+	test_chain();
+	test_chainlen();
+	test_badndp();
+	test_baddgram();
+	if (failed) {
+		printf("%d checks failed\n", failed);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
+
+#endif /* !FUZZ */